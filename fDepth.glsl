@@ -0,0 +1,6 @@
+// Fragment shader for the depth pre-pass, which only writes depth.
+#version 150
+
+void main()
+{
+}
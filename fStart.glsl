@@ -1,129 +1,156 @@
 // Part[g] -- put items into fshader.
 // Part[h] -- adjust specular
+// Lights are read from a texture buffer (see updateLights in scene-start.cpp),
+// and each fragment is lit only by the lights listed for its cluster (see
+// Clustered lighting) plus the directional lights.
+#version 150
+
+// Variant switches.  scene-start.cpp defines these after the #version line,
+// building a program for each combination it needs (see Shader program), so
+// the code that a scene or object doesn't need is compiled out.  The
+// defaults here give the general version.
+#ifndef TEXTURED
+#define TEXTURED 1            // 0 when the surface texture is plain white
+#endif
+#ifndef SPOT_LIGHTS
+#define SPOT_LIGHTS 1         // 0 when there are no spotlights
+#endif
+#ifndef CLUSTERED_LIGHTS
+#define CLUSTERED_LIGHTS 1    // 0 when there are no point lights or spotlights
+#endif
+#ifndef DIRECTIONAL_LIGHTS
+#define DIRECTIONAL_LIGHTS -1 // The number of directional lights, -1 to read it from LightBlock
+#endif
+
+#define LIGHT_POINT 1
+#define LIGHT_DIRECTIONAL 2
+#define LIGHT_SPOT 3
+
+in vec2 texCoord;  // The third coordinate is always 0.0 and is discarded
+in vec3 pos;   //equivalent to fV in Lecture Notes
+in vec3 fN; 
+
+// Material terms, passed through by vStart.glsl
+flat in vec3 fAmbient, fDiffuse, fSpecular;
+flat in float fShininess, fTexScale;
+
+out vec4 fragColor;
+
+uniform sampler2D texSampler;
+
+// Four texels per light - must match LightData in scene-start.cpp:
+// position (eye coordinates), colour * brightness with the brightness in
+// alpha, spotlight direction and cutoff, then the type and radius.
+uniform samplerBuffer lightData;
+uniform usamplerBuffer clusterLights; // Start and count in lightIndices per cluster
+uniform usamplerBuffer lightIndices;  // Lights listed per cluster
+
+// std140 layout - must match LightBlockData in scene-start.cpp
+layout(std140) uniform LightBlock {
+    vec4 ambientLight;  // Sum of every light's colour * brightness
+    ivec4 clusterGrid;  // Tiles across, tiles down, depth slices, number of directional lights
+    vec4 clusterMap;    // Pixels per tile across and down, slice = log(depth) * z + w
+};
+
+// Adds light number i's diffuse and specular contributions.  directional
+// is always a constant, so the test for it is compiled out.
+void addLight(int i, bool directional, vec3 N, vec3 E, inout vec3 color, inout vec3 specular)
+{
+    vec4 position = texelFetch(lightData, 4*i);
+    vec4 lightColor = texelFetch(lightData, 4*i + 1);
+    vec4 spot = texelFetch(lightData, 4*i + 2);
+    vec4 range = texelFetch(lightData, 4*i + 3);
 
-varying vec2 texCoord;  // The third coordinate is always 0.0 and is discarded
-uniform sampler2D texture;
-varying vec3 pos;   //equivalent to fV in Lecture Notes
-varying vec3 fN; 
-
-uniform vec3 AmbientProduct, DiffuseProduct, SpecularProduct;
-
-uniform vec4 LightPosition;
-uniform vec4 Light_2_Position;
-uniform vec4 Light_3_Position;
-
-uniform float Shininess;
-uniform float brightness;
-uniform float brightness_2;
-uniform float brightness_3;
-uniform float pitch;
-uniform float yaw;
-uniform vec3 color_1;
-uniform vec3 color_2;
-uniform vec3 color_3;
-uniform float texScale;
-
-void main()
-{	
-    
     // The vector to the light from the vertex    
-    vec3 Lvec = LightPosition.xyz - pos;
-    vec3 Lvec_2 = Light_2_Position.xyz - pos;
-    vec3 Lvec_3 = Light_3_Position.xyz - pos;
+    vec3 Lvec = position.xyz - pos;
+    vec3 L = normalize( Lvec );   // Direction to the light source
 
-    vec3 direct; //Directional vector
-    direct.x = cos(radians(yaw))*cos(radians(pitch));
-    direct.y = sin(radians(pitch));
-    direct.z = sin(radians(yaw))*cos(radians(pitch));
+    // Light source information
+    vec3 lightInfo = lightColor.rgb;
+    float brightness = lightColor.a;
 
-    // Unit direction vectors for Blinn-Phong shading calculation
-    vec3 L = normalize( Lvec );   // Direction to the light source
-    vec3 E = normalize( -pos );   // Direction to the eye/camera
-    vec3 H = normalize( L + E );  // Halfway vector
+    // Point and spot lights fall off with distance, directional lights don't
+    //Custom chosen values for attenuation
+    float distscale = 1.0;
+    if (!directional) {
+        float dist = length(Lvec);
+        if (dist > range.y) return; // Too dim to matter, and may not be in this cluster's list
+        distscale = 1.0/(1.0+0.14*dist + 0.07*dist*dist); //Value derived from table - https://learnopengl.com/Lighting/Light-casters
+    }
 
-    vec3 L2 = normalize(Lvec_2);
-    vec3 H2 = normalize(L2 + E);
+#if SPOT_LIGHTS
+    if (!directional && int(range.x) == LIGHT_SPOT) {
+        float theta = dot(L, spot.xyz); // For rotational light
 
-    vec3 L3 = normalize( Lvec_3 );   // Direction to the light source
+        vec3 diffuse = max(theta, 0.0) * lightInfo * fDiffuse;
+        float Ks = pow( max(theta, 0.0), fShininess );
 
-    float theta = dot(L3,normalize(direct)); // For rotational light
+        if (theta > spot.w)
+            color += distscale*diffuse;
 
-    // Transform vertex normal into eye coordinates (assumes scaling
-    // is uniform across dimensions)
-    vec3 N = normalize(fN);
+        if (theta >= 0.0)
+            specular += distscale * Ks * brightness * fSpecular;
+        return;
+    }
+#endif
 
-    // Light source information
-    vec3 Light_1_info = color_1 * brightness;
-    vec3 Light_2_info = color_2 * brightness_2;
-    vec3 Light_3_info = color_3 * brightness_3;
-    
-
-    // Compute terms in the illumination equation
-    // Ambient calculations
-    vec3 ambient =  Light_1_info * AmbientProduct;
-    vec3 ambient_2 = Light_2_info * AmbientProduct;
-    vec3 ambient_3 = Light_3_info * AmbientProduct;
-
-    //Diffuse calculations
-    float Kd = max( dot(L, N), 0.0 );
-    float Kd_2 = max( dot(L2, N), 0.0);
-    float Kd_3 = max(theta, 0.0);
-    vec3  diffuse = Kd * Light_1_info * DiffuseProduct;
-    vec3  diffuse_2 = Kd_2 * Light_2_info * DiffuseProduct;
-    vec3 diffuse_3 = Kd_3 * Light_3_info * DiffuseProduct;
+    vec3 H = normalize( L + E );  // Halfway vector
 
+    float Kd = max( dot(L, N), 0.0 );
+    vec3  diffuse = Kd * lightInfo * fDiffuse;
 
     // Specular calculation 
     // For part H, multiply by brightness to take it into consideration
-    float Ks = pow( max(dot(N, H), 0.0), Shininess );
-    float Ks_2 = pow( max(dot(N, H2), 0.0), Shininess);
-    float Ks_3 = pow( max(theta,0.0), Shininess);
-    vec3  specular = Ks * brightness * SpecularProduct;
-    vec3  specular_2 = Ks_2 * brightness_2 * SpecularProduct;
-    vec3 specular_3 = Ks_3 * brightness_3 * SpecularProduct;
-
-    
-    if (dot(L, N) < 0.0 ) {
-	specular = vec3(0.0, 0.0, 0.0);
-    } 
-
-    if(dot(L2, N) < 0.0) {
-    specular_2 = vec3(0.0, 0.0, 0.0);
-    }
-
-    if(theta < 0.0){
-    specular_3 = vec3(0.0, 0.0, 0.0);
-    }
+    float Ks = pow( max(dot(N, H), 0.0), fShininess );
 
+    // distscale accounts for light source distance
+    color += distscale*diffuse;
 
-    // globalAmbient is independent of distance from the light source
-    vec3 globalAmbient = vec3(0.05, 0.05, 0.05);
-
-    //Position of lights
-    vec3 lpos = LightPosition.xyz;
-    vec3 l3pos = Light_3_Position.xyz;
+    if (dot(L, N) >= 0.0)
+        specular += distscale * Ks * brightness * fSpecular;
+}
 
-    // Distance between light and object, used in color calculations
-    float dist = sqrt((lpos[0]-pos[0])*(lpos[0]-pos[0])+(lpos[1]-pos[1])*(lpos[1]-pos[1])+(lpos[2]-pos[2])*(lpos[2]-pos[2]));
-    float dist_3 = sqrt((l3pos[0]-pos[0])*(l3pos[0]-pos[0])+(l3pos[1]-pos[1])*(l3pos[1]-pos[1])+(l3pos[2]-pos[2])*(l3pos[2]-pos[2]));
+void main()
+{	
+    vec3 E = normalize( -pos );   // Direction to the eye/camera
 
-    //Custom chosen values for attenuation
-    float distscale = 1.0/(1.0+0.14*dist + 0.07*dist*dist); //Value derived from table - https://learnopengl.com/Lighting/Light-casters
-    float distscale_3 = 1.0/(1.0+0.14*dist_3 + 0.07*dist_3*dist_3); //Value derived from table - https://learnopengl.com/Lighting/Light-casters
+    // Transform vertex normal into eye coordinates (assumes scaling
+    // is uniform across dimensions)
+    vec3 N = normalize(fN);
 
-    vec4 color_3;
+    // Every light's ambient term is independent of position, so they are
+    // summed once per frame
+    vec3 color = ambientLight.rgb * fAmbient;
+    vec3 specular = vec3(0.0, 0.0, 0.0);
+
+#if DIRECTIONAL_LIGHTS >= 0
+    for (int i = 0; i < DIRECTIONAL_LIGHTS; i++)
+#else
+    for (int i = 0; i < clusterGrid.w; i++)
+#endif
+        addLight(i, true, N, E, color, specular);
+
+#if CLUSTERED_LIGHTS
+    // Find this fragment's cluster, and the point and spot lights that reach it
+    ivec3 cell = ivec3(ivec2(gl_FragCoord.xy / clusterMap.xy),
+                       int(floor(log(max(-pos.z, 1e-6)) * clusterMap.z + clusterMap.w)));
+    cell = clamp(cell, ivec3(0), clusterGrid.xyz - 1);
+    int cluster = (cell.z * clusterGrid.y + cell.y) * clusterGrid.x + cell.x;
+    uvec2 list = texelFetch(clusterLights, cluster).xy;
+
+    for (uint j = 0u; j < list.y; j++)
+        addLight(int(texelFetch(lightIndices, int(list.x + j)).x), false, N, E, color, specular);
+#endif
 
-    if(theta > 0.7) {
-        color_3 = vec4(ambient_3 + distscale_3*(diffuse_3), 1.0); //original
-    }
-    else {
-        color_3 = vec4(ambient_3, 1.0);
-    }
+    // globalAmbient is independent of distance from the light source
+    vec3 globalAmbient = vec3(0.05, 0.05, 0.05);
 
-    // distscale accounts for light source distance
-    vec4 color = vec4(ambient + distscale*( diffuse), 1.0); //original
-    vec4 color_2 = vec4((ambient_2 + diffuse_2), 1.0);
+#if TEXTURED
+    vec4 surface = texture( texSampler, texCoord * fTexScale );
+#else
+    vec4 surface = vec4(1.0); // What a plain white texture gives
+#endif
 
-    gl_FragColor = vec4(globalAmbient, 1.0) + (color + color_2 + color_3) * texture2D( texture, texCoord * texScale ) + vec4((distscale * specular) + specular_2 + (distscale_3 * specular_3), 1.0);
+    fragColor = vec4(globalAmbient, 1.0) + vec4(color, 1.0) * surface + vec4(specular, 1.0);
 
 }
@@ -2,10 +2,38 @@
 #include "Angel.h"
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+
+// EGL, for rendering without a window (see Headless rendering)
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <dirent.h>
 #include <time.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h> // For computeModelViews
+#endif
+
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 // Open Asset Importer header files (in ../../assimp--3.0.1270/include)
 // This is a standard open source library for loading meshes, see gnatidread.h
@@ -24,10 +52,28 @@ using namespace std;        // Import the C++ standard functions (e.g., min)
 
 
 // IDs for the GLSL program and GLSL variables.
-GLuint shaderProgram; // The number identifying the GLSL shader program
-GLuint vPosition, vNormal, vTexCoord; // IDs for vshader input vars (from glGetAttribLocation)
+GLuint shaderProgram; // The current shader variant's program - see Shader program
+// vshader inputs, at fixed locations so every shader variant can use the same VAOs
+GLuint vPosition = 0, vNormal = 1, vTexCoord = 2;
+GLint iModel = 3, iAmbient = 7, iDiffuse = 8, iSpecular = 9, iShineTexScale = 10; // Per-instance,
+                                                                 // iModel is a mat4 so uses 3 to 6
 GLuint projectionU, modelViewU; // IDs for uniform variables (from glGetUniformLocation)
 
+// Locations of the remaining uniforms.  These are looked up once per shader
+// program in initShaderLocations rather than by name on every draw.
+typedef struct {
+    GLint texture;
+    GLint instanced; // Selects the per-instance attributes in vStart.glsl
+    GLuint lightBlock; // Index of the LightBlock uniform block
+    GLuint objectBlock; // Index of the ObjectBlock uniform block, see Per-object data
+    GLint objectIndex;  // The record in it for the next draw
+} UniformLocations;
+
+UniformLocations uLoc;
+
+GLuint depthProgram; // Depth only program from vDepth.glsl/fDepth.glsl - see Depth pre-pass
+GLint depthProjectionU, depthModelViewU, depthInstancedU; // Its uniforms
+
 static float viewDist = 1.5; // Distance from the camera to the centre of the scene
 static float camRotSidewaysDeg=0; // rotates the camera sideways around the centre
 static float camRotUpAndOverDeg=20; // rotates the camera up and over the centre.
@@ -40,380 +86,5436 @@ char lab[] = "Project1";
 char *programName = NULL; // Set in main 
 int numDisplayCalls = 0; // Used to calculate the number of frames per second
 
+bool headless = false; // Rendering offscreen without GLUT - see Headless rendering
+
+bool fixedSeed = false;   // Set by -seed (and -headless) so the starting scene is repeatable
+unsigned int randomSeed = 1;
+
+// Redrawing.  By default a frame is only drawn when something has changed:
+// postRedisplay flags that a redraw is needed, and redrawTick, run by a GLUT
+// timer fpsCap times a second (60 with no cap), draws a frame if one is
+// needed or a mesh or texture is still loading, and otherwise counts a
+// skipped tick.  In continuous mode (-continuous, or the 'c' key) every tick
+// draws a frame, and with no cap idle() draws frames as fast as possible.
+bool continuousRedraw = false; // Set by -continuous, toggled with 'c'
+int fpsCap = 0;                // Set by -fpscap, 0 for no cap
+bool redrawNeeded = true;      // Set by postRedisplay, cleared by display()
+int skippedTicks = 0;          // Ticks with nothing to draw, reset each second by timer()
+
+// Must be called after any change that affects what is drawn.
+static void postRedisplay()
+{
+    redrawNeeded = true;
+}
+
 //------Meshes----------------------------------------------------------------
-// Uses the type aiMesh from ../../assimp--3.0.1270/include/assimp/mesh.h
 //                           (numMeshes is defined in gnatidread.h)
-aiMesh* meshes[numMeshes]; // For each mesh we have a pointer to the mesh to draw
-GLuint vaoIDs[numMeshes]; // and a corresponding VAO ID from glGenVertexArrays
+const int placeholderMesh = numMeshes; // Extra slot for a cube drawn while a mesh is loading
+
+enum LoadState { NOT_REQUESTED, LOADING, LOADED }; // See Background loading
+
+LoadState meshLoadStates[numMeshes]; // Whether each mesh has been loaded (GL thread only)
+GLuint vaoIDs[numMeshes+1]; // and a corresponding VAO ID from glGenVertexArrays
+GLenum indexTypes[numMeshes+1]; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT for the mesh's element buffer
+
+const int maxLods = 4; // Most levels of detail per mesh - see Levels of detail
+
+typedef struct {
+    GLuint first, count; // A range of indices in a mesh's element buffer
+} IndexRange;
+
+int meshLods[numMeshes+1];                  // Number of levels of detail each mesh has
+IndexRange lodRanges[numMeshes+1][maxLods]; // The indices of each level; level 0 is the full mesh
+
+typedef struct {
+    vec3 center;   // Centre of the bounding box, and of the bounding sphere
+    vec3 halfSize; // Half the bounding box's size along each axis
+    float radius;  // Radius of the bounding sphere
+} MeshBounds;
+
+MeshBounds meshBounds[numMeshes+1]; // Set as each mesh is uploaded - see Frustum culling
 
 // -----Textures--------------------------------------------------------------
 //                           (numTextures is defined in gnatidread.h)
-texture* textures[numTextures]; // An array of texture pointers - see gnatidread.h
-GLuint textureIDs[numTextures]; // Stores the IDs returned by glGenTextures
+const int placeholderTexture = numTextures; // Extra slot for a texture used while one is loading
+
+LoadState textureLoadStates[numTextures]; // Whether each texture has been loaded (GL thread only)
+GLuint textureIDs[numTextures+1]; // Stores the IDs returned by glGenTextures
+bool textureIsWhite[numTextures+1]; // No effect, so drawn with an untextured shader variant
 
 //------Scene Objects---------------------------------------------------------
 //
-// For each object in a scene we store the following
-// Note: the following is exactly what the sample solution uses, you can do things differently if you want.
+// For each object in a scene we store the following.  The scene is a
+// structure of arrays: each field, or group of fields that are always used
+// together like the material, has its own array indexed by object number.  A
+// pass over the scene then only reads the fields it needs, and the arrays grow
+// as objects are added - see newSceneObject and eraseSceneObject.
 typedef struct {
-    vec4 loc;
-    float scale;
-    float angles[3]; // rotations around X, Y and Z axes.
     float diffuse, specular, ambient; // Amount of each light component
     float shine;
     vec3 rgb;
     float brightness; // Multiplies all colours
-    int meshId;
-    int texId;
     float texScale;
-} SceneObject;
+} Material;
 
-const int maxObjects = 1024; // Scenes with more than 1024 objects seem unlikely
+typedef struct {
+    float col[4][4]; // Column-major
+} ModelMatrix;
 
-SceneObject sceneObjs[maxObjects]; // An array storing the objects currently in the scene.
-int nObjects = 0;    // How many objects are currenly in the scene.
+typedef struct {
+    vector<vec4> loc;
+    vector<float> scale;
+    vector<vec3> angles; // rotations around X, Y and Z axes.
+    vector<Material> material;
+    vector<int> meshId;
+    vector<int> texId;
+    vector<int> lightType; // LIGHT_NONE for ordinary objects, see LightType below
+    vector<unsigned char> lod; // Level of detail last drawn with, see Level of detail selection
+
+    // Model matrices cached from loc, scale and angles by computeModelViews,
+    // which recomputes only those flagged in modelDirty.
+    vector<ModelMatrix> model;
+    vector<unsigned char> modelDirty;
+} SceneStore;
+
+SceneStore scene; // The objects currently in the scene.
+int nObjects = 0;    // How many objects are currenly in the scene (the length of each array).
+
+bool bvhStale = true; // Set when objects are added or deleted - see Bounding volume hierarchy
+
+// Must be called whenever an existing object's loc, scale or angles change,
+// so its cached model matrix is recomputed.  New objects start out dirty.
+static void markMoved(int obj)
+{
+    scene.modelDirty[obj] = 1;
+}
 int currObject = -1; // The current object
 int toolObj = -1;    // The object currently being modified
 
 
 int menu_in_use = 0; // For checking menu is open or not //KV
 
-//----------------------------------------------------------------------------
+//------Lights----------------------------------------------------------------
 //
-// Loads a texture by number, and binds it for later use.    
-void loadTextureIfNotAlreadyLoaded(int i)
+// Any scene object with a lightType other than LIGHT_NONE is a light.  Each
+// frame updateLights packs the lights into lightData, directional lights
+// first, and uploads them to a texture buffer, four RGBA32F texels per light.
+// The small LightBlock uniform buffer (std140) holds what every fragment
+// needs: the summed ambient light and how to find the fragment's cluster (see
+// Clustered lighting).  The values and layouts here must match fStart.glsl.
+enum LightType { LIGHT_NONE = 0, LIGHT_POINT = 1, LIGHT_DIRECTIONAL = 2, LIGHT_SPOT = 3 };
+
+const int maxLights = 4096;
+const GLuint lightBlockBinding = 0; // Uniform buffer binding point for LightBlock
+const GLuint objectBlockBinding = 1; // And for ObjectBlock, see Per-object data
+const int lightDataUnit = 1, clusterLightUnit = 2, lightIndexUnit = 3; // Texture units for the light buffers
+const float spotCutoff = 0.7; // Cosine of the spotlight's half angle
+
+// Point and spot lights are ignored beyond the distance where their brightness
+// times the distance attenuation in fStart.glsl falls below lightCutoff, so
+// that each only reaches a limited number of clusters.  See lightRadius.
+const float lightCutoff = 1.0 / 256;
+
+typedef struct {
+    vec4 position;  // Eye coordinates
+    vec4 color;     // rgb = colour * brightness, a = brightness
+    vec4 spot;      // xyz = spotlight direction, w = cosine of the cutoff angle
+    vec4 range;     // x = LightType, y = radius (0 for directional lights)
+} LightData;
+
+typedef struct {
+    vec4 ambient;          // Sum of every light's colour * brightness
+    GLint clusterGrid[4];  // Tiles across, tiles down, depth slices, number of directional lights
+    GLfloat clusterMap[4]; // Pixels per tile across and down, then slice = log(depth) * [2] + [3]
+} LightBlockData;
+
+vector<LightData> lightData; // CPU copy of the light texture buffer
+LightBlockData lightBlock;   // CPU copy of the light uniform buffer
+GLuint lightBuffer;          // The uniform buffer object itself
+int numDirectionalLights;    // At the start of lightData
+
+//------Profiling-------------------------------------------------------------
+//
+// With profiling on (-profile, -trace or the 'p' key), display() and the work
+// it does are timed on the CPU by ProfileScope objects, which time from their
+// creation to the end of their block, and the GPU's share of the depth
+// pre-pass and the lit pass by GL_TIME_ELAPSED queries.  The queries are read
+// a frame or two later, once their results are available, so that asking
+// never stalls the CPU; a result that is still not ready when its query is
+// needed again is dropped.  Draw calls, binds and triangles are counted every
+// frame (see countDraw), profiling or not.
+//
+// The results go to:
+//  - An overlay in the bottom-left corner of the window (the 'p' key, or
+//    -profile), with a bar for each of the last profileHistory frames, CPU
+//    time in green and GPU time in orange, and lines at 1/60 and 1/30
+//    second.  The frame time percentiles are added to the title by timer().
+//  - A summary of the percentiles and the time per scope after a -headless run.
+//  - A Chrome trace (-trace file), written at exit, for chrome://tracing or
+//    https://ui.perfetto.dev.  GPU times are only durations, so the GPU track
+//    starts each frame's passes when its display() does.
+
+atomic<bool> profiling(false);    // Set by -profile and -trace, and by 'p' unless tracing
+bool profileOverlay = false;      // Set by -profile, toggled with 'p'
+const char* traceFileName = NULL; // Set by -trace
+
+const int maxProfileScopes = 64;
+const int profileHistory = 120;     // Frames shown by the overlay
+const int gpuQueryFrames = 3;       // Frames of queries in flight
+const size_t maxTraceEvents = 4000000;
+const int gpuTraceThread = 1000;    // Chrome trace thread number for the GPU
+
+// Per-frame counts, kept whether profiling or not
+typedef struct {
+    int drawCalls, binds;
+    long triangles;
+} ProfileCounters;
+
+ProfileCounters frameCounters, lastFrameCounters; // This frame, and the last one drawn
+
+typedef struct {
+    const char* name;
+    double totalMs;  // Since resetProfile, on every thread
+    long calls;
+} ProfileScopeStats;
+
+ProfileScopeStats profileScopes[maxProfileScopes];
+atomic<int> numProfileScopes(0);
+
+typedef struct {
+    int scope;       // Index in profileScopes
+    int thread;      // 0 for the main thread, see profileThread
+    double startUs, durationUs; // Since profileStart
+} TraceEvent;
+
+typedef struct {
+    double startUs;
+    ProfileCounters counters;
+} TraceFrame;
+
+mutex profileMutex; // Guards the above for other threads, and registering scopes
+vector<TraceEvent> traceEvents;       // On the main thread
+vector<TraceEvent> threadTraceEvents; // On other threads, guarded by profileMutex
+vector<TraceFrame> traceFrames;
+chrono::steady_clock::time_point profileStart = chrono::steady_clock::now();
+thread::id profileMainThread = this_thread::get_id();
+
+// The GPU timers
+enum { GPU_DEPTH_PREPASS, GPU_LIT_PASS, numGpuSections };
+const char* gpuSectionNames[numGpuSections] = { "Depth pre-pass (GPU)", "Lit pass (GPU)" };
+int gpuSectionScopes[numGpuSections];
+
+typedef struct {
+    GLuint queries[numGpuSections];
+    bool issued[numGpuSections];
+    long frame;      // profileFrame the queries were issued in
+    double startUs;  // When that frame started
+} GpuQuerySet;
+
+GpuQuerySet gpuQuerySets[gpuQueryFrames];
+bool gpuTimers = false;   // Set when the GL has timer queries
+int droppedGpuTimes = 0;
+
+// Per-frame results
+long profileFrame = 0;    // Frames drawn while profiling
+bool profilingFrame = false; // profiling was on when this frame started
+chrono::steady_clock::time_point frameStartTime;
+float historyCpuMs[profileHistory], historyGpuMs[profileHistory]; // By profileFrame
+vector<float> runCpuMs, runGpuMs; // Since resetProfile, for the -headless summary
+long runCounterFrames = 0;
+ProfileCounters runCounters;
+
+static double profileMicroseconds(chrono::steady_clock::time_point t)
 {
-    if (textures[i] != NULL) return; // The texture is already loaded.
+    return chrono::duration<double, micro>(t - profileStart).count();
+}
 
-    textures[i] = loadTextureNum(i); CheckError();
-    glActiveTexture(GL_TEXTURE0); CheckError();
+// Returns the index in profileScopes for name, adding it if it's new.  Names
+// are compared as pointers first, since they're normally the same literal.
+static int profileScopeIndex(const char* name)
+{
+    int n = numProfileScopes.load(memory_order_acquire);
+    for (int i=0; i < n; i++)
+        if (profileScopes[i].name == name || strcmp(profileScopes[i].name, name) == 0) return i;
+
+    lock_guard<mutex> lock(profileMutex);
+    n = numProfileScopes.load(memory_order_relaxed);
+    for (int i=0; i < n; i++)
+        if (strcmp(profileScopes[i].name, name) == 0) return i;
+    if (n == maxProfileScopes) {
+        printf("Error - more than %d profile scopes\n", maxProfileScopes);
+        exit(1);
+    }
+    profileScopes[n].name = name;
+    profileScopes[n].totalMs = 0;
+    profileScopes[n].calls = 0;
+    numProfileScopes.store(n+1, memory_order_release);
+    return n;
+}
 
-    // Based on: http://www.opengl.org/wiki/Common_Mistakes
-    glBindTexture(GL_TEXTURE_2D, textureIDs[i]); CheckError();
+// A small number for each thread, for the trace: 0 for the main thread.
+static int profileThread()
+{
+    static atomic<int> numThreads(1);
+    static thread_local int number = -1;
+    if (number < 0)
+        number = this_thread::get_id() == profileMainThread ? 0 : numThreads++;
+    return number;
+}
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, textures[i]->width, textures[i]->height,
-                 0, GL_RGB, GL_UNSIGNED_BYTE, textures[i]->rgbData); CheckError();
-    glGenerateMipmap(GL_TEXTURE_2D); CheckError();
+static void recordTraceEvent(int scope, int thread, double startUs, double durationUs)
+{
+    if (traceFileName == NULL) return;
+    vector<TraceEvent>& events = thread == 0 || thread == gpuTraceThread ? traceEvents : threadTraceEvents;
+    if (events.size() == maxTraceEvents) {
+        printf("The trace is full, later events are left out\n");
+        events.push_back(TraceEvent()); // So this is only reported once
+        events.back().scope = -1;
+    }
+    if (events.size() > maxTraceEvents) return;
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT); CheckError();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT); CheckError();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); CheckError();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); CheckError();
+    TraceEvent event = { scope, thread, startUs, durationUs };
+    events.push_back(event);
+}
+
+// Adds a timed scope's results.  Only the main thread works without the lock.
+static void recordScope(int scope, chrono::steady_clock::time_point start,
+                        chrono::steady_clock::time_point end)
+{
+    int thread = profileThread();
+    unique_lock<mutex> lock(profileMutex, defer_lock);
+    if (thread != 0) lock.lock();
+
+    ProfileScopeStats& s = profileScopes[scope];
+    double startUs = profileMicroseconds(start), endUs = profileMicroseconds(end);
+    s.totalMs += (endUs - startUs) / 1000.0;
+    s.calls++;
+    recordTraceEvent(scope, thread, startUs, endUs - startUs);
+}
+
+// Times the rest of the block it is declared in, when profiling.
+class ProfileScope {
+public:
+    ProfileScope(const char* name) : scope(-1)
+    {
+        if (!profiling) return;
+        scope = profileScopeIndex(name);
+        start = chrono::steady_clock::now();
+    }
 
-    glBindTexture(GL_TEXTURE_2D, 0); CheckError(); // Back to default texture
+    ~ProfileScope()
+    {
+        if (scope >= 0) recordScope(scope, start, chrono::steady_clock::now());
+    }
+
+private:
+    int scope;
+    chrono::steady_clock::time_point start;
+};
+
+// Counts a draw of indexCount indices, instances times.
+static void countDraw(int indexCount, int instances)
+{
+    frameCounters.drawCalls++;
+    frameCounters.triangles += (long)indexCount / 3 * instances;
 }
 
-//------Mesh loading----------------------------------------------------------
-//
-// The following uses the Open Asset Importer library via loadMesh in 
-// gnatidread.h to load models in .x format, including vertex positions, 
-// normals, and texture coordinates.
-// You shouldn't need to modify this - it's called from drawMesh below.
+// Clears the times and counts behind the -headless summary.
+static void resetProfile()
+{
+    int n = numProfileScopes;
+    lock_guard<mutex> lock(profileMutex);
+    for (int i=0; i < n; i++) {
+        profileScopes[i].totalMs = 0;
+        profileScopes[i].calls = 0;
+    }
+    runCpuMs.clear();
+    runGpuMs.clear();
+    runCounterFrames = 0;
+    memset(&runCounters, 0, sizeof(runCounters));
+    droppedGpuTimes = 0;
+}
 
-void loadMeshIfNotAlreadyLoaded(int meshNumber)
+static void initProfiling()
 {
-    if (meshNumber>=numMeshes || meshNumber < 0) {
-        printf("Error - no such model number");
-        exit(1);
+    gpuTimers = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    if (gpuTimers)
+        for (int f=0; f < gpuQueryFrames; f++) {
+            glGenQueries(numGpuSections, gpuQuerySets[f].queries);
+            memset(gpuQuerySets[f].issued, 0, sizeof(gpuQuerySets[f].issued));
+        }
+    for (int s=0; s < numGpuSections; s++)
+        gpuSectionScopes[s] = profileScopeIndex(gpuSectionNames[s]);
+}
+
+// Reads a set of queries if all their results are available, or if wait is
+// set.  Returns false if they aren't.
+static bool collectGpuTimes(GpuQuerySet& set, bool wait)
+{
+    bool any = false;
+    for (int s=0; s < numGpuSections; s++) {
+        if (!set.issued[s]) continue;
+        GLint available = 1;
+        if (!wait) glGetQueryObjectiv(set.queries[s], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return false;
+        any = true;
+    }
+    if (!any) return true;
+
+    double gpuMs = 0, startUs = set.startUs;
+    for (int s=0; s < numGpuSections; s++) {
+        if (!set.issued[s]) continue;
+        GLuint64 ns;
+        glGetQueryObjectui64v(set.queries[s], GL_QUERY_RESULT, &ns);
+        set.issued[s] = false;
+
+        ProfileScopeStats& stats = profileScopes[gpuSectionScopes[s]];
+        stats.totalMs += ns / 1e6;
+        stats.calls++;
+        recordTraceEvent(gpuSectionScopes[s], gpuTraceThread, startUs, ns / 1e3);
+        startUs += ns / 1e3;
+        gpuMs += ns / 1e6;
     }
 
-    if (meshes[meshNumber] != NULL)
-        return; // Already loaded
+    if (set.frame > profileFrame - profileHistory)
+        historyGpuMs[set.frame % profileHistory] = gpuMs;
+    runGpuMs.push_back(gpuMs);
+    return true;
+}
+
+// Called at the start of display().
+static void profileBeginFrame()
+{
+    memset(&frameCounters, 0, sizeof(frameCounters));
+    profilingFrame = profiling;
+    if (!profilingFrame) return;
+
+    frameStartTime = chrono::steady_clock::now();
+    historyCpuMs[profileFrame % profileHistory] = 0;
+    historyGpuMs[profileFrame % profileHistory] = 0;
+    if (!gpuTimers) return;
+
+    for (int f=0; f < gpuQueryFrames; f++)
+        if (f != profileFrame % gpuQueryFrames) collectGpuTimes(gpuQuerySets[f], false);
+
+    // The queries to be reused must be read now, or dropped
+    GpuQuerySet& set = gpuQuerySets[profileFrame % gpuQueryFrames];
+    if (!collectGpuTimes(set, false)) {
+        droppedGpuTimes++;
+        memset(set.issued, 0, sizeof(set.issued));
+    }
+    set.frame = profileFrame;
+    set.startUs = profileMicroseconds(frameStartTime);
+}
 
-    aiMesh* mesh = loadMesh(meshNumber);
-    meshes[meshNumber] = mesh;
+// Times the GPU's work on a section of this frame, up to gpuTimerEnd.  Only
+// one section can be timed at once.
+static void gpuTimerBegin(int section)
+{
+    if (!profilingFrame || !gpuTimers) return;
+    GpuQuerySet& set = gpuQuerySets[profileFrame % gpuQueryFrames];
+    glBeginQuery(GL_TIME_ELAPSED, set.queries[section]);
+    set.issued[section] = true;
+}
 
-    glBindVertexArray( vaoIDs[meshNumber] );
+static void gpuTimerEnd()
+{
+    if (profilingFrame && gpuTimers) glEndQuery(GL_TIME_ELAPSED);
+}
 
-    // Create and initialize a buffer object for positions and texture coordinates, initially empty.
-    // mesh->mTextureCoords[0] has space for up to 3 dimensions, but we only need 2.
-    GLuint buffer[1];
-    glGenBuffers( 1, buffer );
-    glBindBuffer( GL_ARRAY_BUFFER, buffer[0] );
-    glBufferData( GL_ARRAY_BUFFER, sizeof(float)*(3+3+3)*mesh->mNumVertices,
-                  NULL, GL_STATIC_DRAW );
+// Called at the end of display().
+static void profileEndFrame()
+{
+    lastFrameCounters = frameCounters;
+    if (!profilingFrame) return;
+
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    double cpuMs = chrono::duration<double, milli>(end - frameStartTime).count();
+    historyCpuMs[profileFrame % profileHistory] = cpuMs;
+    runCpuMs.push_back(cpuMs);
+
+    runCounterFrames++;
+    runCounters.drawCalls += frameCounters.drawCalls;
+    runCounters.binds += frameCounters.binds;
+    runCounters.triangles += frameCounters.triangles;
+
+    if (traceFileName != NULL) {
+        TraceFrame frame = { profileMicroseconds(frameStartTime), frameCounters };
+        traceFrames.push_back(frame);
+    }
+    profileFrame++;
+}
 
-    int nVerts = mesh->mNumVertices;
-    // Next, we load the position and texCoord data in parts.    
-    glBufferSubData( GL_ARRAY_BUFFER, 0, sizeof(float)*3*nVerts, mesh->mVertices );
-    glBufferSubData( GL_ARRAY_BUFFER, sizeof(float)*3*nVerts, sizeof(float)*3*nVerts, mesh->mTextureCoords[0] );
-    glBufferSubData( GL_ARRAY_BUFFER, sizeof(float)*6*nVerts, sizeof(float)*3*nVerts, mesh->mNormals);
+// Sets p50, p95 and p99 from times, sorting it.  Returns false if it's empty.
+static bool percentiles(vector<float>& times, double p[3])
+{
+    if (times.empty()) return false;
+    sort(times.begin(), times.end());
+    const double fractions[3] = { 0.5, 0.95, 0.99 };
+    for (int i=0; i < 3; i++)
+        p[i] = times[min(times.size()-1, (size_t)(fractions[i] * times.size()))];
+    return true;
+}
 
-    // Load the element index data
-    GLuint elements[mesh->mNumFaces*3];
-    for (GLuint i=0; i < mesh->mNumFaces; i++) {
-        elements[i*3] = mesh->mFaces[i].mIndices[0];
-        elements[i*3+1] = mesh->mFaces[i].mIndices[1];
-        elements[i*3+2] = mesh->mFaces[i].mIndices[2];
+// The percentiles of the CPU and GPU times of the frames shown by the overlay.
+static bool historyPercentiles(double cpu[3], double gpu[3])
+{
+    vector<float> cpuTimes, gpuTimes;
+    for (long f = max(0L, profileFrame - profileHistory); f < profileFrame; f++) {
+        cpuTimes.push_back(historyCpuMs[f % profileHistory]);
+        if (historyGpuMs[f % profileHistory] > 0) gpuTimes.push_back(historyGpuMs[f % profileHistory]);
     }
+    if (!percentiles(gpuTimes, gpu)) gpu[0] = gpu[1] = gpu[2] = 0;
+    return percentiles(cpuTimes, cpu);
+}
 
-    GLuint elementBufferId[1];
-    glGenBuffers(1, elementBufferId);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBufferId[0]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * mesh->mNumFaces * 3, elements, GL_STATIC_DRAW);
+// Fills a rectangle with a colour, with scissored clears so that no shader
+// or vertex buffer is needed.
+static void fillRect(int x, int y, int width, int height, float r, float g, float b)
+{
+    if (width <= 0 || height <= 0) return;
+    glScissor(x, y, width, height);
+    glClearColor(r, g, b, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
 
-    // vPosition it actually 4D - the conversion sets the fourth dimension (i.e. w) to 1.0                 
-    glVertexAttribPointer( vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
-    glEnableVertexAttribArray( vPosition );
+// Draws the overlay, see above.  Each frame is three pixels wide: two for its
+// CPU time and one for its GPU time, at 4 pixels per millisecond.
+static void drawProfileOverlay()
+{
+    if (!profileOverlay || !profiling || headless) return;
+    const int x0 = 8, y0 = 8, pxPerMs = 4, maxHeight = 50 * pxPerMs;
+
+    GLfloat clearColor[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+    glEnable(GL_SCISSOR_TEST);
+
+    fillRect(x0, y0, 3 * profileHistory, maxHeight, 0.1, 0.1, 0.1);
+    for (long f = max(0L, profileFrame - profileHistory); f < profileFrame; f++) {
+        int x = x0 + 3 * (f - (profileFrame - profileHistory));
+        float cpu = historyCpuMs[f % profileHistory], gpu = historyGpuMs[f % profileHistory];
+        fillRect(x, y0, 2, min(maxHeight, (int)(cpu * pxPerMs + 0.5)), 0.2, 0.8, 0.2);
+        fillRect(x+2, y0, 1, min(maxHeight, (int)(gpu * pxPerMs + 0.5)), 1.0, 0.6, 0.1);
+    }
+    fillRect(x0, y0 + (int)(1000.0/60 * pxPerMs), 3 * profileHistory, 1, 0.8, 0.8, 0.8);
+    fillRect(x0, y0 + (int)(1000.0/30 * pxPerMs), 3 * profileHistory, 1, 0.8, 0.8, 0.8);
 
-    // vTexCoord is actually 2D - the third dimension is ignored (it's always 0.0)
-    glVertexAttribPointer( vTexCoord, 3, GL_FLOAT, GL_FALSE, 0,
-                           BUFFER_OFFSET(sizeof(float)*3*mesh->mNumVertices) );
-    glEnableVertexAttribArray( vTexCoord );
-    glVertexAttribPointer( vNormal, 3, GL_FLOAT, GL_FALSE, 0,
-                           BUFFER_OFFSET(sizeof(float)*6*mesh->mNumVertices) );
-    glEnableVertexAttribArray( vNormal );
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
     CheckError();
 }
 
-//----------------------------------------------------------------------------
+static bool profileScopeSlower(const ProfileScopeStats& a, const ProfileScopeStats& b)
+{
+    return a.totalMs > b.totalMs;
+}
 
-static void mouseClickOrScroll(int button, int state, int x, int y)
+// Prints the percentiles, counts and time per scope since resetProfile, for
+// -headless runs.  Waits for the GPU times still in flight.
+static void printProfile()
 {
+    if (!profiling || runCounterFrames == 0) return;
+    if (gpuTimers)
+        for (int f=0; f < gpuQueryFrames; f++) collectGpuTimes(gpuQuerySets[f], true);
+
+    double cpu[3], gpu[3];
+    long frames = runCounterFrames;
+    percentiles(runCpuMs, cpu);
+    printf("  Profile: display() p50 %.3f ms, p95 %.3f ms, p99 %.3f ms", cpu[0], cpu[1], cpu[2]);
+    if (percentiles(runGpuMs, gpu))
+        printf("; GPU p50 %.3f ms, p95 %.3f ms, p99 %.3f ms (%d dropped)", gpu[0], gpu[1], gpu[2], droppedGpuTimes);
+    printf("\n  Per frame: %.1f draw calls, %.1f binds, %.0f triangles\n",
+           (double)runCounters.drawCalls / frames, (double)runCounters.binds / frames,
+           (double)runCounters.triangles / frames);
+
+    lock_guard<mutex> lock(profileMutex);
+    vector<ProfileScopeStats> scopes(profileScopes, profileScopes + numProfileScopes);
+    sort(scopes.begin(), scopes.end(), profileScopeSlower);
+    for (size_t i=0; i < scopes.size(); i++)
+        if (scopes[i].calls > 0)
+            printf("  %-24s %9.3f ms per frame, %8.1f calls per frame\n", scopes[i].name,
+                   scopes[i].totalMs / frames, (double)scopes[i].calls / frames);
+}
 
-    if (button==GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
-        if (glutGetModifiers()!=GLUT_ACTIVE_SHIFT) activateTool(button);
-        else activateTool(GLUT_LEFT_BUTTON);
+// Writes the Chrome trace.  Registered with atexit by main for -trace.
+static void writeTrace()
+{
+    FILE* f = fopen(traceFileName, "w");
+    if (f == NULL) {
+        printf("Error - could not write the trace to %s\n", traceFileName);
+        return;
+    }
+
+    lock_guard<mutex> lock(profileMutex);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"%s\"}},\n", programName);
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Main\"}},\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}",
+            gpuTraceThread);
+
+    traceEvents.insert(traceEvents.end(), threadTraceEvents.begin(), threadTraceEvents.end());
+    for (size_t i=0; i < traceEvents.size(); i++) {
+        const TraceEvent& e = traceEvents[i];
+        if (e.scope < 0) continue;
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                profileScopes[e.scope].name, e.thread, e.startUs, e.durationUs);
+    }
+    for (size_t i=0; i < traceFrames.size(); i++) {
+        const TraceFrame& t = traceFrames[i];
+        fprintf(f, ",\n{\"name\":\"Frame\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+                   "\"args\":{\"draw calls\":%d,\"binds\":%d,\"triangles\":%ld}}",
+                t.startUs, t.counters.drawCalls, t.counters.binds, t.counters.triangles);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    printf("Wrote %d trace events to %s\n", (int)(traceEvents.size() + traceFrames.size()), traceFileName);
+}
+
+//------Render queue----------------------------------------------------------
+//
+// display() draws objects in the order given by renderQueue, which is sorted by
+// (program, texture, mesh) so that consecutive draws share as much GL state as
+// possible.  All program, texture and VAO binds go through the functions below,
+// which skip a bind when that state is already current and count the skips.
+
+typedef struct {
+    unsigned long long key; // See renderKey
+    int obj;                // Object number in scene
+} RenderItem;
+
+vector<RenderItem> renderQueue;
+
+typedef struct {
+    int programBinds, textureBinds, vaoBinds;       // Binds actually issued
+    int programsElided, texturesElided, vaosElided; // Binds skipped as redundant
+} BindCounters;
+
+BindCounters bindCounters; // Reset each second by timer()
+
+GLuint boundProgram = 0, boundTexture = 0, boundVAO = 0; // Current GL state
+
+static void useProgram(GLuint program)
+{
+    if (program == boundProgram) { bindCounters.programsElided++; return; }
+    glUseProgram(program);
+    boundProgram = program;
+    bindCounters.programBinds++;
+    frameCounters.binds++;
+}
+
+// Binds a 2D texture on texture unit 0.  The other units hold the light
+// texture buffers, which stay bound (see initLightBuffers).
+static void bindTexture(GLuint textureID)
+{
+    if (textureID == boundTexture) { bindCounters.texturesElided++; return; }
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    boundTexture = textureID;
+    bindCounters.textureBinds++;
+    frameCounters.binds++;
+}
+
+static void bindVertexArray(GLuint vao)
+{
+    if (vao == boundVAO) { bindCounters.vaosElided++; return; }
+    glBindVertexArray(vao);
+    boundVAO = vao;
+    bindCounters.vaoBinds++;
+    frameCounters.binds++;
+}
+
+static int objectVariant(int obj);
+
+// The sort key puts the shader variant in the top bits, then the texture,
+// then the mesh, then the level of detail selectLods chose this frame.
+static unsigned long long renderKey(int obj)
+{
+    return ((unsigned long long)objectVariant(obj) << 40)
+         | ((unsigned long long)(scene.texId[obj] & 0xfffff) << 20)
+         | (unsigned long long)(scene.meshId[obj] & 0x3ffff) << 2
+         | (unsigned long long)(scene.lod[obj] & 3);
+}
+
+static int variantOfKey(unsigned long long key)
+{
+    return key >> 40;
+}
+
+// The part of a render key that matters when only depth is drawn: the mesh
+// and level of detail.
+static unsigned long long depthOnlyKey(unsigned long long key)
+{
+    return key & 0xfffff;
+}
+
+static bool renderItemBefore(const RenderItem& a, const RenderItem& b)
+{
+    return a.key < b.key || (a.key == b.key && a.obj < b.obj);
+}
 
+// Refreshes the sort keys and re-sorts the queue.  The queue is kept from the
+// previous frame and is normally still in order, so an insertion sort is close
+// to linear.  When objects are added or deleted the queue is rebuilt and fully
+// sorted instead, since it may then be far from sorted.
+static void updateRenderQueue()
+{
+    bool rebuild = (int)renderQueue.size() != nObjects;
+    if (rebuild) {
+        renderQueue.resize(nObjects);
+        for (int i=0; i < nObjects; i++) renderQueue[i].obj = i;
     }
 
-    else if (button==GLUT_LEFT_BUTTON && state == GLUT_UP) deactivateTool();
+    for (int i=0; i < nObjects; i++)
+        renderQueue[i].key = renderKey(renderQueue[i].obj);
 
-    else if (button==GLUT_MIDDLE_BUTTON && state==GLUT_DOWN) { 
-        activateTool(button);
+    if (rebuild) {
+        sort(renderQueue.begin(), renderQueue.end(), renderItemBefore);
+        return;
     }
 
-    else if (button==GLUT_MIDDLE_BUTTON && state==GLUT_UP) deactivateTool();
+    for (int i=1; i < nObjects; i++) {
+        RenderItem item = renderQueue[i];
+        int j = i;
+        for (; j > 0 && renderQueue[j-1].key > item.key; j--)
+            renderQueue[j] = renderQueue[j-1];
+        renderQueue[j] = item;
+    }
+}
 
-    else if (button == 3) { // scroll up
-        viewDist = (viewDist < 0.0 ? viewDist : viewDist*0.8) - 0.05;
+//------Levels of detail------------------------------------------------------
+//
+// Each mesh has up to maxLods levels of detail.  Level 0 is the mesh as
+// loaded, and each later level has about lodTriangleRatios[level] of its
+// triangles.  The levels share the mesh's vertices and follow each other in
+// its element buffer, so a level is just a range of indices (lodRanges).
+// display() picks a level for each object from its size on screen - see Level
+// of detail selection.
+//
+// simplifyMesh makes the levels when a mesh is built from Assimp's data, by
+// repeatedly collapsing the edge that moves the surface least, as measured by
+// quadric error metrics (Garland and Heckbert 1997).  An edge is collapsed
+// onto one of its ends, so no new vertices are needed.  Collapses are between
+// positions rather than vertices, since vertices at a texture seam or crease
+// share a position but have different normals or texture coordinates.  When
+// a position is collapsed, each of its vertices is replaced by the other
+// position's vertex with the closest normal and texture coordinates, so seams
+// stay closed.
+
+const float lodTriangleRatios[maxLods] = { 1.0, 0.5, 0.25, 0.1 };
+const float lodMaxErrors[maxLods] = { 0, 0.01, 0.03, 0.08 }; // Largest error allowed, as a fraction of the mesh's size
+const float lodMinReduction = 0.8;  // Levels with more than this fraction of the last level's triangles are dropped
+const double lodBorderWeight = 10;  // How strongly open borders are kept in place
+
+typedef struct {
+    double q[10]; // Symmetric 4x4 matrix: aa, ab, ac, ad, bb, bc, bd, cc, cd, dd
+} Quadric;
+
+typedef struct {
+    double cost;
+    int from, to;                    // Positions, collapsing from onto to
+    unsigned fromVersion, toVersion; // See Simplifier::versions
+} Collapse;
+
+typedef struct {
+    const aiMesh* mesh;
+    int numPositions;
+    vector<int> positionOf;          // Position number of each vertex
+    vector<GLuint> positionVertices; // Vertices grouped by position
+    vector<int> positionStart;       // Where each position's group starts in positionVertices
+
+    vector<Quadric> quadrics;        // Per position
+    vector<unsigned> versions;       // Per position, bumped whenever its quadric or triangles change
+    vector<vector<int> > triangles;  // Triangles using each position, including dead ones
+
+    vector<GLuint> corners;          // Three vertices per triangle
+    vector<unsigned char> alive;     // Per triangle, cleared when it collapses to nothing
+    int liveTriangles;
+
+    vector<Collapse> heap;           // Cheapest first, see collapseCostlier
+} Simplifier;
+
+typedef struct {
+    float p[3];
+    GLuint vertex;
+} SortedVertex;
+
+static bool sortedVertexBefore(const SortedVertex& a, const SortedVertex& b)
+{
+    for (int i=0; i < 3; i++)
+        if (a.p[i] != b.p[i]) return a.p[i] < b.p[i];
+    return a.vertex < b.vertex;
+}
+
+static bool collapseCostlier(const Collapse& a, const Collapse& b)
+{
+    return a.cost > b.cost;
+}
+
+static const aiVector3D& positionPoint(const Simplifier& s, int position)
+{
+    return s.mesh->mVertices[s.positionVertices[s.positionStart[position]]];
+}
+
+// Adds the squared distance to the plane ax + by + cz + d = 0, times weight.
+static void addPlane(Quadric* q, double a, double b, double c, double d, double weight)
+{
+    double terms[10] = { a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d };
+    for (int i=0; i < 10; i++) q->q[i] += terms[i] * weight;
+}
+
+static double quadricError(const Quadric& q, const aiVector3D& p)
+{
+    const double* m = q.q;
+    double x = p.x, y = p.y, z = p.z;
+    return m[0]*x*x + 2*m[1]*x*y + 2*m[2]*x*z + 2*m[3]*x
+         + m[4]*y*y + 2*m[5]*y*z + 2*m[6]*y
+         + m[7]*z*z + 2*m[8]*z
+         + m[9];
+}
+
+// The (unnormalized) normal of the triangle with corners a, b and c.
+static void triangleNormal(const aiVector3D& a, const aiVector3D& b, const aiVector3D& c, double n[3])
+{
+    double e1[3] = { b.x-a.x, b.y-a.y, b.z-a.z }, e2[3] = { c.x-a.x, c.y-a.y, c.z-a.z };
+    n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+    n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+    n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+}
+
+// How different two vertices' normals and texture coordinates are.
+static float attributeDistance(const aiMesh* mesh, GLuint a, GLuint b)
+{
+    const aiVector3D &na = mesh->mNormals[a], &nb = mesh->mNormals[b];
+    float d = (na.x-nb.x)*(na.x-nb.x) + (na.y-nb.y)*(na.y-nb.y) + (na.z-nb.z)*(na.z-nb.z);
+    const aiVector3D* uv = mesh->mTextureCoords[0];
+    if (uv != NULL)
+        d += (uv[a].x-uv[b].x)*(uv[a].x-uv[b].x) + (uv[a].y-uv[b].y)*(uv[a].y-uv[b].y);
+    return d;
+}
+
+// Queues the cheaper way of collapsing the edge between positions a and b.
+static void pushCollapse(Simplifier& s, int a, int b)
+{
+    Quadric sum = s.quadrics[a];
+    for (int i=0; i < 10; i++) sum.q[i] += s.quadrics[b].q[i];
+
+    Collapse c;
+    double aOntoB = quadricError(sum, positionPoint(s, b)), bOntoA = quadricError(sum, positionPoint(s, a));
+    c.cost = min(aOntoB, bOntoA);
+    c.from = aOntoB <= bOntoA ? a : b;
+    c.to = aOntoB <= bOntoA ? b : a;
+    c.fromVersion = s.versions[c.from];
+    c.toVersion = s.versions[c.to];
+    s.heap.push_back(c);
+    push_heap(s.heap.begin(), s.heap.end(), collapseCostlier);
+}
+
+// The positions sharing a live triangle with position p, sorted.
+static void positionNeighbours(const Simplifier& s, int p, vector<int>* out)
+{
+    out->clear();
+    for (size_t i=0; i < s.triangles[p].size(); i++) {
+        int t = s.triangles[p][i];
+        if (!s.alive[t]) continue;
+        for (int k=0; k < 3; k++) {
+            int q = s.positionOf[s.corners[3*t+k]];
+            if (q != p) out->push_back(q);
+        }
     }
+    sort(out->begin(), out->end());
+    out->erase(unique(out->begin(), out->end()), out->end());
+}
 
-    else if (button == 4) { // scroll down
-        viewDist = (viewDist < 0.0 ? viewDist : viewDist*1.25) + 0.05;
+// Collapses position from onto position to, unless that would fold a
+// triangle over or make the mesh non-manifold.
+static bool tryCollapse(Simplifier& s, int from, int to)
+{
+    // The ends of an edge may only share the neighbours on the triangles
+    // either side of it (the link condition)
+    vector<int> fromNeighbours, toNeighbours;
+    positionNeighbours(s, from, &fromNeighbours);
+    positionNeighbours(s, to, &toNeighbours);
+    int shared = 0;
+    for (size_t i=0, j=0; i < fromNeighbours.size() && j < toNeighbours.size(); ) {
+        if (fromNeighbours[i] < toNeighbours[j]) i++;
+        else if (fromNeighbours[i] > toNeighbours[j]) j++;
+        else { shared++; i++; j++; }
+    }
+
+    int edgeTriangles = 0;
+    const aiVector3D& target = positionPoint(s, to);
+    for (size_t i=0; i < s.triangles[from].size(); i++) {
+        int t = s.triangles[from][i];
+        if (!s.alive[t]) continue;
+
+        int p[3];
+        for (int k=0; k < 3; k++) p[k] = s.positionOf[s.corners[3*t+k]];
+        if (p[0] == to || p[1] == to || p[2] == to) { edgeTriangles++; continue; }
+
+        // Triangles that stay must not flip over
+        const aiVector3D* before[3], *after[3];
+        for (int k=0; k < 3; k++) {
+            before[k] = &positionPoint(s, p[k]);
+            after[k] = p[k] == from ? &target : before[k];
+        }
+        double n0[3], n1[3];
+        triangleNormal(*before[0], *before[1], *before[2], n0);
+        triangleNormal(*after[0], *after[1], *after[2], n1);
+        if (n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2] <= 0) return false;
     }
+    if (shared > edgeTriangles) return false;
+
+    for (size_t i=0; i < s.triangles[from].size(); i++) {
+        int t = s.triangles[from][i];
+        if (!s.alive[t]) continue;
+
+        bool usesTo = false;
+        for (int k=0; k < 3; k++) usesTo = usesTo || s.positionOf[s.corners[3*t+k]] == to;
+        if (usesTo) {
+            s.alive[t] = 0;
+            s.liveTriangles--;
+            continue;
+        }
+
+        for (int k=0; k < 3; k++) {
+            GLuint v = s.corners[3*t+k];
+            if (s.positionOf[v] != from) continue;
 
+            GLuint best = s.positionVertices[s.positionStart[to]];
+            float bestDistance = 1e30;
+            for (int j=s.positionStart[to]; j < s.positionStart[to+1]; j++) {
+                float d = attributeDistance(s.mesh, v, s.positionVertices[j]);
+                if (d < bestDistance) { bestDistance = d; best = s.positionVertices[j]; }
+            }
+            s.corners[3*t+k] = best;
+        }
+        s.triangles[to].push_back(t);
+    }
+    s.triangles[from].clear();
+    for (int i=0; i < 10; i++) s.quadrics[to].q[i] += s.quadrics[from].q[i];
+    s.versions[from]++;
+    s.versions[to]++;
+
+    positionNeighbours(s, to, &toNeighbours);
+    for (size_t i=0; i < toNeighbours.size(); i++) pushCollapse(s, to, toNeighbours[i]);
+    return true;
 }
 
-//----------------------------------------------------------------------------
-void myLeftClickFunc(int button, int state, int x, int y){}
+// Builds the simplified levels of detail of mesh, whose full triangle list is
+// indices.  levels[l] gets the indices of level l+1.  Returns the number of
+// levels made, which is fewer than maxLods-1 when the mesh can't usefully be
+// simplified that far.  Safe to call from the loader threads.
+static int simplifyMesh(const aiMesh* mesh, const vector<GLuint>& indices, vector<GLuint> levels[maxLods-1])
+{
+    int numTriangles = indices.size() / 3;
+    GLuint numVertices = mesh->mNumVertices;
+    if (numTriangles == 0 || mesh->mNormals == NULL) return 0;
+
+    Simplifier s;
+    s.mesh = mesh;
+
+    // Group the vertices by position
+    vector<SortedVertex> sorted(numVertices);
+    for (GLuint v=0; v < numVertices; v++) {
+        memcpy(sorted[v].p, &mesh->mVertices[v], sizeof(sorted[v].p));
+        sorted[v].vertex = v;
+    }
+    sort(sorted.begin(), sorted.end(), sortedVertexBefore);
+
+    s.positionOf.resize(numVertices);
+    s.positionVertices.resize(numVertices);
+    s.numPositions = 0;
+    for (GLuint i=0; i < numVertices; i++) {
+        if (i == 0 || memcmp(sorted[i].p, sorted[i-1].p, sizeof(sorted[i].p)) != 0) {
+            s.positionStart.push_back(i);
+            s.numPositions++;
+        }
+        s.positionOf[sorted[i].vertex] = s.numPositions-1;
+        s.positionVertices[i] = sorted[i].vertex;
+    }
+    s.positionStart.push_back(numVertices);
+
+    s.quadrics.assign(s.numPositions, Quadric());
+    s.versions.assign(s.numPositions, 0);
+    s.triangles.resize(s.numPositions);
+    s.corners = indices;
+    s.alive.assign(numTriangles, 0);
+    s.liveTriangles = 0;
+
+    // Each position's quadric sums the squared distances to the planes of
+    // its triangles.  Triangles that are degenerate once the vertices are
+    // grouped by position are left out of the simplified levels.
+    vector<pair<pair<int, int>, int> > edges; // Each triangle's edges, as (positions, triangle)
+    for (int t=0; t < numTriangles; t++) {
+        int p[3];
+        for (int k=0; k < 3; k++) p[k] = s.positionOf[s.corners[3*t+k]];
+        if (p[0] == p[1] || p[1] == p[2] || p[2] == p[0]) continue;
+
+        double n[3];
+        triangleNormal(positionPoint(s, p[0]), positionPoint(s, p[1]), positionPoint(s, p[2]), n);
+        double length = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+        if (length == 0) continue;
+        for (int i=0; i < 3; i++) n[i] /= length;
+
+        const aiVector3D& p0 = positionPoint(s, p[0]);
+        double d = -(n[0]*p0.x + n[1]*p0.y + n[2]*p0.z);
+        for (int k=0; k < 3; k++) {
+            addPlane(&s.quadrics[p[k]], n[0], n[1], n[2], d, 1);
+            s.triangles[p[k]].push_back(t);
+            edges.push_back(make_pair(make_pair(min(p[k], p[(k+1)%3]), max(p[k], p[(k+1)%3])), t));
+        }
+        s.alive[t] = 1;
+        s.liveTriangles++;
+    }
 
-//----------------------------------------------------------------------------
+    // Edges with only one triangle are on a border.  A plane through the
+    // edge at right angles to the triangle stops the border being pulled in.
+    sort(edges.begin(), edges.end());
+
+    for (size_t i=0; i < edges.size(); ) {
+        size_t j = i+1;
+        while (j < edges.size() && edges[j].first == edges[i].first) j++;
+
+        int a = edges[i].first.first, b = edges[i].first.second;
+        if (j == i+1) {
+            int t = edges[i].second;
+            double n[3];
+            triangleNormal(s.mesh->mVertices[s.corners[3*t]], s.mesh->mVertices[s.corners[3*t+1]],
+                           s.mesh->mVertices[s.corners[3*t+2]], n);
+            const aiVector3D &pa = positionPoint(s, a), &pb = positionPoint(s, b);
+            double e[3] = { pb.x-pa.x, pb.y-pa.y, pb.z-pa.z };
+            double m[3] = { e[1]*n[2] - e[2]*n[1], e[2]*n[0] - e[0]*n[2], e[0]*n[1] - e[1]*n[0] };
+            double length = sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+            if (length > 0) {
+                for (int k=0; k < 3; k++) m[k] /= length;
+                double d = -(m[0]*pa.x + m[1]*pa.y + m[2]*pa.z);
+                addPlane(&s.quadrics[a], m[0], m[1], m[2], d, lodBorderWeight);
+                addPlane(&s.quadrics[b], m[0], m[1], m[2], d, lodBorderWeight);
+            }
+        }
+        i = j;
+    }
+
+    for (size_t i=0; i < edges.size(); i++)
+        if (i == 0 || edges[i].first != edges[i-1].first)
+            pushCollapse(s, edges[i].first.first, edges[i].first.second);
+
+    // Collapse the cheapest edges until each level's triangle count is
+    // reached, or the error grows too large.  The errors allowed are about
+    // 2-3 pixels at the sizes each level is drawn at (see lodPixelSizes).
+    double size = 0;
+    for (int a=0; a < 3; a++) {
+        float lo = 1e30, hi = -1e30;
+        for (GLuint v=0; v < numVertices; v++) {
+            lo = min(lo, (&mesh->mVertices[v].x)[a]);
+            hi = max(hi, (&mesh->mVertices[v].x)[a]);
+        }
+        size = max(size, (double)(hi - lo));
+    }
+
+    int numLevels = 0, lastTriangles = numTriangles;
+    for (int level=1; level < maxLods; level++) {
+        int target = numTriangles * lodTriangleRatios[level];
+        double maxCost = (lodMaxErrors[level] * size) * (lodMaxErrors[level] * size);
+        while (s.liveTriangles > target && !s.heap.empty()) {
+            Collapse c = s.heap.front();
+            bool current = c.fromVersion == s.versions[c.from] && c.toVersion == s.versions[c.to];
+            if (current && c.cost > maxCost) break;
+
+            pop_heap(s.heap.begin(), s.heap.end(), collapseCostlier);
+            s.heap.pop_back();
+            if (current) tryCollapse(s, c.from, c.to);
+        }
+
+        if (s.liveTriangles > lodMinReduction * lastTriangles) break;
+        levels[numLevels].clear();
+        for (int t=0; t < numTriangles; t++)
+            if (s.alive[t]) levels[numLevels].insert(levels[numLevels].end(), &s.corners[3*t], &s.corners[3*t+3]);
+        numLevels++;
+        lastTriangles = s.liveTriangles;
+    }
+    return numLevels;
+}
+
+//------Mesh optimisation-----------------------------------------------------
+//
+// Assimp's face order is whatever the modelling tool wrote, which often
+// makes poor use of the GPU's post-transform vertex cache: a vertex that has
+// fallen out of the cache is shaded again when a later triangle uses it.
+// buildMeshData therefore reorders each level of detail's triangles with
+// three passes, none of which changes what is drawn:
+//  - optimiseVertexCache: Tom Forsyth's linear-speed vertex cache
+//    optimisation, which greedily picks the next triangle by how recently its
+//    vertices were used and how few triangles they have left.
+//  - optimiseOverdraw: splits the result into clusters where the cache would
+//    be cold anyway, and draws outward-facing clusters first so they hide
+//    more of the rest of the mesh (after Sander et al., "Fast triangle
+//    reordering for vertex locality and reduced overdraw", 2007).
+//  - The vertices are then renumbered in the order they are first used
+//    (vertexFetchOrder), so vertex fetches move through memory in order.
+// The cache is measured as the average cache miss ratio (ACMR): vertices
+// shaded per triangle with a simulated FIFO cache of fifoCacheSize vertices,
+// between 0.5 for a perfect order and 3.  -bakemeshes reports it for each
+// mesh before and after.
+
+const int forsythCacheSize = 32; // Size of the LRU cache modelled by optimiseVertexCache
+const int fifoCacheSize = 16;    // Size of the FIFO cache modelled by fifoCacheMisses
+
+// Forsyth's score for a vertex at position cachePos in the LRU cache (-1 for
+// not in it) with remaining triangles still to draw.
+static float forsythVertexScore(int cachePos, int remaining)
+{
+    if (remaining == 0) return -1;
+
+    float score = 0;
+    if (cachePos >= 0) {
+        if (cachePos < 3) score = 0.75; // Just used: slightly penalised, to avoid long thin strips
+        else score = pow(1.0f - (float)(cachePos - 3) / (forsythCacheSize - 3), 1.5f);
+    }
+    return score + 2.0f * pow((float)remaining, -0.5f); // Favour finishing off vertices
+}
+
+// Uses vertex v with a simulated FIFO cache of fifoCacheSize vertices,
+// returning true if it misses.  insertedAt holds the number of misses so far
+// when each vertex last went into the cache, 0 for never, and *misses the
+// total.
+static bool fifoCacheMiss(vector<size_t>& insertedAt, size_t* misses, GLuint v)
+{
+    if (insertedAt[v] != 0 && *misses - insertedAt[v] < (size_t)fifoCacheSize) return false;
+    insertedAt[v] = ++*misses;
+    return true;
+}
+
+// Counts the vertices a FIFO cache of fifoCacheSize vertices would miss
+// drawing count indices.
+static size_t fifoCacheMisses(const GLuint* indices, size_t count, GLuint numVertices)
+{
+    vector<size_t> insertedAt(numVertices, 0);
+    size_t misses = 0;
+    for (size_t i=0; i < count; i++) fifoCacheMiss(insertedAt, &misses, indices[i]);
+    return misses;
+}
+
+static float acmr(const vector<GLuint>& indices, GLuint numVertices)
+{
+    if (indices.empty()) return 0;
+    return fifoCacheMisses(&indices[0], indices.size(), numVertices) / (indices.size() / 3.0f);
+}
+
+// Reorders the triangles in indices for the vertex cache, with Forsyth's
+// algorithm.
+static void optimiseVertexCache(vector<GLuint>& indices, GLuint numVertices)
+{
+    int numTriangles = indices.size() / 3;
+    if (numTriangles == 0) return;
+
+    // Each vertex's triangles still to draw are triangleList[triangleStart[v]
+    // .. triangleStart[v]+remaining[v]-1]
+    vector<int> remaining(numVertices, 0), triangleStart(numVertices+1, 0);
+    for (size_t i=0; i < indices.size(); i++) remaining[indices[i]]++;
+    for (GLuint v=0; v < numVertices; v++) triangleStart[v+1] = triangleStart[v] + remaining[v];
+    vector<int> triangleList(indices.size()), filled(numVertices, 0);
+    for (size_t i=0; i < indices.size(); i++) {
+        GLuint v = indices[i];
+        triangleList[triangleStart[v] + filled[v]++] = i / 3;
+    }
+
+    vector<int> cachePos(numVertices, -1);
+    vector<float> vertexScore(numVertices), triangleScore(numTriangles, 0);
+    for (GLuint v=0; v < numVertices; v++) vertexScore[v] = forsythVertexScore(-1, remaining[v]);
+    for (size_t i=0; i < indices.size(); i++) triangleScore[i/3] += vertexScore[indices[i]];
+
+    vector<unsigned char> drawn(numTriangles, 0);
+    vector<GLuint> output;
+    output.reserve(indices.size());
+    vector<GLuint> cache, newCache;
+    int best = 0, nextUndrawn = 0; // nextUndrawn: where to look when the cache has nothing to offer
+
+    for (int n=0; n < numTriangles; n++) {
+        if (best < 0) {
+            while (drawn[nextUndrawn]) nextUndrawn++;
+            best = nextUndrawn;
+        }
+        drawn[best] = 1;
+
+        // Draw it, moving its vertices to the front of the cache
+        const GLuint* tri = &indices[3*best];
+        newCache.assign(tri, tri+3);
+        for (size_t i=0; i < cache.size(); i++)
+            if (cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2])
+                newCache.push_back(cache[i]);
+
+        for (int k=0; k < 3; k++) {
+            GLuint v = tri[k];
+            output.push_back(v);
+            int* list = &triangleList[triangleStart[v]];
+            for (int i=0; i < remaining[v]; i++) {
+                if (list[i] == best) {
+                    list[i] = list[remaining[v]-1];
+                    remaining[v]--;
+                    break;
+                }
+            }
+        }
+
+        // Rescore the vertices in (or just pushed out of) the cache and their
+        // triangles, and pick the best of those triangles to draw next
+        for (size_t i=0; i < newCache.size(); i++) {
+            GLuint v = newCache[i];
+            cachePos[v] = (int)i < forsythCacheSize ? i : -1;
+            float score = forsythVertexScore(cachePos[v], remaining[v]);
+            float change = score - vertexScore[v];
+            vertexScore[v] = score;
+            for (int j=0; j < remaining[v]; j++)
+                triangleScore[triangleList[triangleStart[v] + j]] += change;
+        }
+
+        best = -1;
+        float bestScore = -1;
+        cache.assign(newCache.begin(), newCache.begin() + min((int)newCache.size(), forsythCacheSize));
+        for (size_t i=0; i < cache.size(); i++) {
+            GLuint v = cache[i];
+            for (int j=0; j < remaining[v]; j++) {
+                int t = triangleList[triangleStart[v] + j];
+                if (triangleScore[t] > bestScore) { bestScore = triangleScore[t]; best = t; }
+            }
+        }
+    }
+    indices.swap(output);
+}
+
+typedef struct {
+    int first, count; // Triangles
+    float sortKey;
+} TriangleCluster;
+
+static bool clusterBefore(const TriangleCluster& a, const TriangleCluster& b)
+{
+    return a.sortKey > b.sortKey;
+}
+
+// Reorders clusters of the cache-optimised triangles in indices to reduce
+// overdraw.  A cluster starts wherever a triangle misses the cache on all
+// three vertices, so moving it costs almost nothing in cache misses.
+static void optimiseOverdraw(vector<GLuint>& indices, const aiVector3D* positions, GLuint numVertices)
+{
+    int numTriangles = indices.size() / 3;
+    if (numTriangles == 0) return;
+
+    // Find the clusters, and the centre of the mesh
+    vector<TriangleCluster> clusters;
+    vector<size_t> insertedAt(numVertices, 0);
+    size_t misses = 0;
+    double meshCentre[3] = { 0, 0, 0 }, meshArea = 0;
+    for (int t=0; t < numTriangles; t++) {
+        int triangleMisses = 0;
+        for (int k=0; k < 3; k++) triangleMisses += fifoCacheMiss(insertedAt, &misses, indices[3*t+k]);
+        if (t == 0 || triangleMisses == 3) {
+            TriangleCluster c = { t, 0, 0 };
+            clusters.push_back(c);
+        }
+        clusters.back().count++;
+
+        const aiVector3D &a = positions[indices[3*t]], &b = positions[indices[3*t+1]], &c = positions[indices[3*t+2]];
+        double n[3];
+        triangleNormal(a, b, c, n);
+        double area = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+        meshCentre[0] += area * (a.x + b.x + c.x) / 3;
+        meshCentre[1] += area * (a.y + b.y + c.y) / 3;
+        meshCentre[2] += area * (a.z + b.z + c.z) / 3;
+        meshArea += area;
+    }
+    if (clusters.size() < 2 || meshArea == 0) return;
+    for (int i=0; i < 3; i++) meshCentre[i] /= meshArea;
+
+    // Clusters further out along their average normal are more likely to be
+    // in front of the rest of the mesh, so they are drawn first
+    for (size_t i=0; i < clusters.size(); i++) {
+        TriangleCluster& cl = clusters[i];
+        double centre[3] = { 0, 0, 0 }, normal[3] = { 0, 0, 0 }, area = 0;
+        for (int t=cl.first; t < cl.first + cl.count; t++) {
+            const aiVector3D &a = positions[indices[3*t]], &b = positions[indices[3*t+1]], &c = positions[indices[3*t+2]];
+            double n[3];
+            triangleNormal(a, b, c, n);
+            double triangleArea = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+            centre[0] += triangleArea * (a.x + b.x + c.x) / 3;
+            centre[1] += triangleArea * (a.y + b.y + c.y) / 3;
+            centre[2] += triangleArea * (a.z + b.z + c.z) / 3;
+            for (int j=0; j < 3; j++) normal[j] += n[j];
+            area += triangleArea;
+        }
+        double normalLength = sqrt(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+        cl.sortKey = 0;
+        if (area > 0 && normalLength > 0)
+            for (int j=0; j < 3; j++)
+                cl.sortKey += (centre[j] / area - meshCentre[j]) * normal[j] / normalLength;
+    }
+    stable_sort(clusters.begin(), clusters.end(), clusterBefore);
+
+    vector<GLuint> output;
+    output.reserve(indices.size());
+    for (size_t i=0; i < clusters.size(); i++)
+        output.insert(output.end(), &indices[3*clusters[i].first], &indices[3*(clusters[i].first + clusters[i].count)]);
+    indices.swap(output);
+}
+
+// Returns the vertices in the order the levels' indices first use them, with
+// any unused vertices at the end, and renumbers the indices to match.
+static vector<GLuint> vertexFetchOrder(vector<GLuint>* levels, int numLods, GLuint numVertices)
+{
+    vector<GLuint> order, newNumber(numVertices, numVertices);
+    order.reserve(numVertices);
+    for (int l=0; l < numLods; l++) {
+        for (size_t i=0; i < levels[l].size(); i++) {
+            GLuint v = levels[l][i];
+            if (newNumber[v] == numVertices) {
+                newNumber[v] = order.size();
+                order.push_back(v);
+            }
+            levels[l][i] = newNumber[v];
+        }
+    }
+    for (GLuint v=0; v < numVertices; v++)
+        if (newNumber[v] == numVertices) order.push_back(v);
+    return order;
+}
+
+//------Mesh loading----------------------------------------------------------
+//
+// The following uses the Open Asset Importer library via loadMesh in 
+// gnatidread.h to load models in .x format, including vertex positions, 
+// normals, and texture coordinates.
+//
+// Loading happens in two steps.  buildMeshData turns an aiMesh into MeshData:
+// vertex and index blobs that are ready to upload, built on the CPU (normally
+// on a loader thread - see Background loading).  uploadMesh then copies the
+// blobs into GL buffers on the GL thread.  The blobs are also kept in a binary
+// mesh cache (see Mesh cache) so later runs can skip Assimp.
+//
+// Vertices are stored in one of two layouts, chosen with -compact on the
+// command line:
+//  - planar: separate float3 arrays of positions, texture coordinates and
+//    normals, one after the other in the buffer (36 bytes per vertex).
+//  - compact: interleaved CompactVertex structs with the normal packed as
+//    GL_INT_2_10_10_10_REV and half-float texture coordinates (20 bytes per
+//    vertex).  Half floats keep about 3 significant digits, which is plenty
+//    for texture coordinates in the usual 0-1 range.
+//
+// Indices are 16 bit when every vertex can be addressed with them, which
+// halves the index memory.  The index blob holds each level of detail's
+// triangles in turn, starting with the full mesh (see Levels of detail).
+
+bool compactVertices = false; // Set by -compact, cleared if unsupported (see init)
+
+enum VertexFormat { VERTEX_PLANAR = 0, VERTEX_COMPACT = 1 };
+
+typedef struct {
+    GLfloat position[3];
+    GLuint normal;         // x, y, z in 10 bit signed normalized fields
+    GLushort texCoord[2];  // Half floats
+} CompactVertex;
+
+typedef struct {
+    int vertexFormat;      // VertexFormat
+    GLuint numVertices, numIndices; // numIndices counts every level of detail
+    GLenum indexType;      // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    int numLods;
+    IndexRange lods[maxLods];
+    float acmrBefore, acmrAfter; // Of level 0, when built by buildMeshData - see Mesh optimisation
+    const unsigned char* vertexData;
+    const unsigned char* indexData;
+    size_t vertexBytes, indexBytes;
+
+    // The blobs live either in storage or in a mapping of a mesh cache file
+    vector<unsigned char> storage;
+    void* mapping;
+    size_t mappingBytes;
+} MeshData;
+
+static size_t vertexSize(int vertexFormat)
+{
+    return vertexFormat == VERTEX_COMPACT ? sizeof(CompactVertex) : sizeof(float)*(3+3+3);
+}
+
+// Converts a float to an IEEE 754 half float, rounding to nearest.
+static GLushort floatToHalf(float f)
+{
+    GLuint bits;
+    memcpy(&bits, &f, sizeof(bits));
+
+    GLuint sign = (bits >> 16) & 0x8000;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    GLuint mantissa = bits & 0x7fffff;
+
+    if (exponent >= 31) // Too large (or inf/nan) - clamp to infinity
+        return sign | 0x7c00;
+    if (exponent <= 0) { // Denormal or zero
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        return sign | ((mantissa >> (14 - exponent)) + ((mantissa >> (13 - exponent)) & 1));
+    }
+    // Rounding may carry into the exponent, which gives the correct result
+    return sign | ((exponent << 10) + (mantissa >> 13) + ((mantissa >> 12) & 1));
+}
+
+// Packs a unit vector into GL_INT_2_10_10_10_REV with w = 0.
+static GLuint packNormal(const aiVector3D& n)
+{
+    float c[3] = { n.x, n.y, n.z };
+    GLuint packed = 0;
+    for (int i=0; i < 3; i++) {
+        float v = c[i] < -1.0f ? -1.0f : (c[i] > 1.0f ? 1.0f : c[i]);
+        int q = (int)floor(v * 511.0f + 0.5f);
+        packed |= ((GLuint)q & 0x3ff) << (10*i);
+    }
+    return packed;
+}
+
+// Writes the vertices of mesh in the planar layout: all the positions, then
+// all the texture coordinates, then all the normals.  Vertex i of the output
+// is vertex order[i] of mesh (see Mesh optimisation).
+// mesh->mTextureCoords[0] has space for up to 3 dimensions, but we only need 2.
+static void writePlanarVertices(const aiMesh* mesh, const vector<GLuint>& order, unsigned char* out)
+{
+    GLuint n = mesh->mNumVertices;
+    aiVector3D* positions = (aiVector3D*)out;
+    aiVector3D* texCoords = positions + n;
+    aiVector3D* normals = texCoords + n;
+    const aiVector3D* uv = mesh->mTextureCoords[0];
+    for (GLuint i=0; i < n; i++) {
+        positions[i] = mesh->mVertices[order[i]];
+        if (uv != NULL) texCoords[i] = uv[order[i]];
+        else memset(&texCoords[i], 0, sizeof(aiVector3D));
+        normals[i] = mesh->mNormals[order[i]];
+    }
+}
+
+// As writePlanarVertices, but in the compact interleaved layout.
+static void writeCompactVertices(const aiMesh* mesh, const vector<GLuint>& order, CompactVertex* out)
+{
+    const aiVector3D* uv = mesh->mTextureCoords[0];
+    for (GLuint i=0; i < mesh->mNumVertices; i++) {
+        GLuint v = order[i];
+        memcpy(out[i].position, &mesh->mVertices[v], sizeof(out[i].position));
+        out[i].normal = packNormal(mesh->mNormals[v]);
+        out[i].texCoord[0] = floatToHalf(uv ? uv[v].x : 0.0f);
+        out[i].texCoord[1] = floatToHalf(uv ? uv[v].y : 0.0f);
+    }
+}
+
+// Copies the triangle indices of mesh into out.
+static void writeIndices(const aiMesh* mesh, GLuint* out)
+{
+    for (GLuint i=0; i < mesh->mNumFaces; i++) {
+        out[i*3] = mesh->mFaces[i].mIndices[0];
+        out[i*3+1] = mesh->mFaces[i].mIndices[1];
+        out[i*3+2] = mesh->mFaces[i].mIndices[2];
+    }
+}
+
+// Copies the indices of each of numLods levels into out, one after the other,
+// converting to Index.
+template <typename Index>
+static void writeLodIndices(const vector<GLuint>* levels, int numLods, Index* out)
+{
+    for (int l=0; l < numLods; l++)
+        for (size_t i=0; i < levels[l].size(); i++)
+            *out++ = levels[l][i];
+}
+
+// Builds the vertex and index blobs for mesh, in the current vertex format.
+// The blobs are on the heap, so large meshes never need big stack arrays.
+static MeshData* buildMeshData(const aiMesh* mesh)
+{
+    MeshData* data = new MeshData();
+    data->vertexFormat = compactVertices ? VERTEX_COMPACT : VERTEX_PLANAR;
+    data->numVertices = mesh->mNumVertices;
+
+    vector<GLuint> levels[maxLods];
+    levels[0].resize(mesh->mNumFaces * 3);
+    if (mesh->mNumFaces > 0) writeIndices(mesh, &levels[0][0]);
+    data->numLods = 1 + simplifyMesh(mesh, levels[0], levels+1);
+
+    data->acmrBefore = acmr(levels[0], data->numVertices);
+    for (int l=0; l < data->numLods; l++) {
+        optimiseVertexCache(levels[l], data->numVertices);
+        optimiseOverdraw(levels[l], mesh->mVertices, data->numVertices);
+    }
+    vector<GLuint> order = vertexFetchOrder(levels, data->numLods, data->numVertices);
+    data->acmrAfter = acmr(levels[0], data->numVertices);
+
+    data->numIndices = 0;
+    for (int l=0; l < data->numLods; l++) {
+        data->lods[l].first = data->numIndices;
+        data->lods[l].count = levels[l].size();
+        data->numIndices += levels[l].size();
+    }
+
+    bool shortIndices = mesh->mNumVertices < 65536;
+    data->indexType = shortIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+    data->vertexBytes = vertexSize(data->vertexFormat) * data->numVertices;
+    data->indexBytes = (shortIndices ? sizeof(GLushort) : sizeof(GLuint)) * data->numIndices;
+    data->storage.resize(data->vertexBytes + data->indexBytes + 1);
+    data->mapping = NULL;
+    data->mappingBytes = 0;
+
+    unsigned char* vertexOut = &data->storage[0];
+    unsigned char* indexOut = vertexOut + data->vertexBytes;
+
+    if (data->vertexFormat == VERTEX_COMPACT)
+        writeCompactVertices(mesh, order, (CompactVertex*)vertexOut);
+    else
+        writePlanarVertices(mesh, order, vertexOut);
+
+    if (shortIndices) writeLodIndices(levels, data->numLods, (GLushort*)indexOut);
+    else writeLodIndices(levels, data->numLods, (GLuint*)indexOut);
+
+    data->vertexData = vertexOut;
+    data->indexData = indexOut;
+    return data;
+}
+
+static void freeMeshData(MeshData* data)
+{
+    if (data->mapping != NULL) munmap(data->mapping, data->mappingBytes);
+    delete data;
+}
+
+// Sets up the vertex attributes of the bound VAO for numVertices vertices in
+// vertexFormat, stored at the start of the bound GL_ARRAY_BUFFER.
+static void setVertexAttribs(int vertexFormat, GLuint numVertices)
+{
+    if (vertexFormat == VERTEX_COMPACT) {
+        GLsizei stride = sizeof(CompactVertex);
+        glVertexAttribPointer( vPosition, 3, GL_FLOAT, GL_FALSE, stride,
+                               BUFFER_OFFSET(offsetof(CompactVertex, position)) );
+        glVertexAttribPointer( vTexCoord, 2, GL_HALF_FLOAT, GL_FALSE, stride,
+                               BUFFER_OFFSET(offsetof(CompactVertex, texCoord)) );
+
+        // Packed formats always have 4 components; the shader ignores w
+        glVertexAttribPointer( vNormal, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride,
+                               BUFFER_OFFSET(offsetof(CompactVertex, normal)) );
+    }
+    else {
+        // vPosition it actually 4D - the conversion sets the fourth dimension (i.e. w) to 1.0                 
+        glVertexAttribPointer( vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
+
+        // vTexCoord is actually 2D - the third dimension is ignored (it's always 0.0)
+        glVertexAttribPointer( vTexCoord, 3, GL_FLOAT, GL_FALSE, 0,
+                               BUFFER_OFFSET(sizeof(float)*3*numVertices) );
+        glVertexAttribPointer( vNormal, 3, GL_FLOAT, GL_FALSE, 0,
+                               BUFFER_OFFSET(sizeof(float)*6*numVertices) );
+    }
+    glEnableVertexAttribArray( vPosition );
+    glEnableVertexAttribArray( vTexCoord );
+    glEnableVertexAttribArray( vNormal );
+    CheckError();
+}
+
+static void checkMeshNumber(int meshNumber)
+{
+    if (meshNumber>=numMeshes || meshNumber < 0) {
+        printf("Error - no such model number");
+        exit(1);
+    }
+}
+
+// Works out a mesh's bounding box, and a bounding sphere about its centre,
+// from the vertex positions.
+static MeshBounds computeMeshBounds(const MeshData* data)
+{
+    // Positions come first in both layouts, contiguous in the planar one
+    size_t stride = data->vertexFormat == VERTEX_COMPACT ? sizeof(CompactVertex) : sizeof(float)*3;
+
+    float lo[3] = { 1e30, 1e30, 1e30 }, hi[3] = { -1e30, -1e30, -1e30 };
+    for (GLuint v=0; v < data->numVertices; v++) {
+        const float* p = (const float*)(data->vertexData + v*stride);
+        for (int i=0; i < 3; i++) {
+            lo[i] = min(lo[i], p[i]);
+            hi[i] = max(hi[i], p[i]);
+        }
+    }
+
+    MeshBounds b;
+    if (data->numVertices == 0) {
+        b.center = b.halfSize = vec3(0.0, 0.0, 0.0);
+        b.radius = 0;
+        return b;
+    }
+    b.center = vec3((lo[0]+hi[0])/2, (lo[1]+hi[1])/2, (lo[2]+hi[2])/2);
+    b.halfSize = vec3((hi[0]-lo[0])/2, (hi[1]-lo[1])/2, (hi[2]-lo[2])/2);
+
+    float radiusSq = 0;
+    for (GLuint v=0; v < data->numVertices; v++) {
+        const float* p = (const float*)(data->vertexData + v*stride);
+        float dx = p[0]-b.center[0], dy = p[1]-b.center[1], dz = p[2]-b.center[2];
+        radiusSq = max(radiusSq, dx*dx + dy*dy + dz*dz);
+    }
+    b.radius = sqrtf(radiusSq);
+    return b;
+}
+
+// Creates the vertex and element buffers for a mesh from its MeshData, which
+// is then freed.  Must be called on the GL thread.
+static void uploadMesh(int meshNumber, MeshData* data)
+{
+    bindVertexArray( vaoIDs[meshNumber] );
+
+    // Create and initialize a buffer object for positions, texture coordinates and normals
+    GLuint buffer[2];
+    glGenBuffers( 2, buffer );
+    glBindBuffer( GL_ARRAY_BUFFER, buffer[0] );
+    glBufferData( GL_ARRAY_BUFFER, data->vertexBytes, data->vertexData, GL_STATIC_DRAW );
+    setVertexAttribs(data->vertexFormat, data->numVertices);
+
+    if (data->vertexFormat == VERTEX_COMPACT) {
+        size_t planarBytes = vertexSize(VERTEX_PLANAR) * data->numVertices;
+        printf("Mesh %d: %u vertices, %lu vertex bytes (%lu saved by -compact)\n",
+               meshNumber, data->numVertices, (unsigned long)data->vertexBytes,
+               (unsigned long)(planarBytes - data->vertexBytes));
+    }
+
+    // Load the element index data
+    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, buffer[1] );
+    glBufferData( GL_ELEMENT_ARRAY_BUFFER, data->indexBytes, data->indexData, GL_STATIC_DRAW );
+    indexTypes[meshNumber] = data->indexType;
+    meshLods[meshNumber] = data->numLods;
+    for (int l=0; l < data->numLods; l++) lodRanges[meshNumber][l] = data->lods[l];
+    CheckError();
+
+    meshBounds[meshNumber] = computeMeshBounds(data);
+    meshLoadStates[meshNumber] = LOADED;
+    bvhStale = true; // Objects using the mesh have changed size
+    freeMeshData(data);
+}
+
+//------Mesh cache------------------------------------------------------------
+//
+// The MeshData for model<n>.x is saved as model<n>.mesh in the same directory:
+// a MeshCacheHeader followed by the vertex blob and then the index blob.  The
+// file is mmap'd and uploaded straight from the mapping.  The header holds a
+// checksum of the .x file and the vertex format, and the cache is rebuilt when
+// either doesn't match.  It also holds the levels of detail's index ranges, so
+// meshes aren't simplified again either.  Not being able to write the cache
+// (e.g. because the models-textures directory is read-only) just means Assimp
+// is used next time.
+// Run with -bakemeshes to build the cache for every model up front.
+
+bool useMeshCache = true; // Cleared by -nomeshcache
+
+const char meshCacheMagic[4] = { 'M', 'S', 'H', 'C' };
+const uint32_t meshCacheVersion = 3; // 2 added levels of detail, 3 optimised their order
+
+typedef struct {
+    char magic[4];            // meshCacheMagic
+    uint32_t version;         // meshCacheVersion
+    uint64_t sourceChecksum;  // checksumFile of the .x file
+    uint64_t sourceBytes;
+    uint32_t vertexFormat;
+    uint32_t numVertices, numIndices;
+    uint32_t indexType;
+    uint64_t vertexBytes, indexBytes;
+    uint32_t numLods;
+    IndexRange lods[maxLods];
+} MeshCacheHeader;
+
+// Maps a whole file read-only, or returns NULL if it can't.
+static void* mapFile(const char* path, size_t* bytes)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) return NULL;
+    *bytes = st.st_size;
+    return mapping;
+}
+
+const uint64_t hashStart = 14695981039346656037ULL;
+
+// Adds n bytes to a 64 bit FNV-1a hash, which starts as hashStart.
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t n)
+{
+    const unsigned char* p = (const unsigned char*)bytes;
+    for (size_t i=0; i < n; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Hash of a file's contents, used to notice changed models.
+static bool checksumFile(const char* path, uint64_t* checksum, uint64_t* bytes)
+{
+    size_t n;
+    const unsigned char* p = (const unsigned char*)mapFile(path, &n);
+    if (p == NULL) return false;
+
+    uint64_t hash = hashBytes(hashStart, p, n);
+    munmap((void*)p, n);
+
+    *checksum = hash;
+    *bytes = n;
+    return true;
+}
+
+static void meshSourcePath(int meshNumber, char* path)
+{
+    sprintf(path, "%s/model%d.x", dataDir, meshNumber);
+}
+
+static void meshCachePath(int meshNumber, char* path)
+{
+    sprintf(path, "%s/model%d.mesh", dataDir, meshNumber);
+}
+
+// Returns MeshData pointing into a mapping of the mesh's cache file, or NULL
+// if there is no valid cache for this version of the source and vertex format.
+static MeshData* loadMeshCache(int meshNumber, uint64_t checksum, uint64_t sourceBytes)
+{
+    char path[256];
+    meshCachePath(meshNumber, path);
+
+    size_t bytes;
+    unsigned char* p = (unsigned char*)mapFile(path, &bytes);
+    if (p == NULL) return NULL;
+
+    const MeshCacheHeader* h = (const MeshCacheHeader*)p;
+    int vertexFormat = compactVertices ? VERTEX_COMPACT : VERTEX_PLANAR;
+    bool valid = bytes >= sizeof(MeshCacheHeader)
+        && memcmp(h->magic, meshCacheMagic, 4) == 0 && h->version == meshCacheVersion
+        && h->sourceChecksum == checksum && h->sourceBytes == sourceBytes
+        && h->vertexFormat == (uint32_t)vertexFormat
+        && h->numLods >= 1 && h->numLods <= (uint32_t)maxLods;
+
+    // The blobs must hold exactly the vertices and indices the header claims,
+    // so that a stale or hand-made cache can't make a draw read past them
+    valid = valid && (h->indexType == GL_UNSIGNED_SHORT || h->indexType == GL_UNSIGNED_INT)
+        && (h->indexType == GL_UNSIGNED_INT || h->numVertices <= 65536)
+        && h->vertexBytes == (uint64_t)h->numVertices * vertexSize(h->vertexFormat)
+        && h->indexBytes == (uint64_t)h->numIndices
+                            * (h->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint))
+        && sizeof(MeshCacheHeader) + h->vertexBytes + h->indexBytes == bytes;
+
+    for (uint32_t l=0; valid && l < h->numLods; l++)
+        valid = (uint64_t)h->lods[l].first + h->lods[l].count <= h->numIndices;
+
+    if (!valid) {
+        munmap(p, bytes);
+        return NULL;
+    }
+
+    MeshData* data = new MeshData();
+    data->vertexFormat = h->vertexFormat;
+    data->numVertices = h->numVertices;
+    data->numIndices = h->numIndices;
+    data->indexType = h->indexType;
+    data->vertexBytes = h->vertexBytes;
+    data->indexBytes = h->indexBytes;
+    data->numLods = h->numLods;
+    memcpy(data->lods, h->lods, sizeof(data->lods));
+    data->vertexData = p + sizeof(MeshCacheHeader);
+    data->indexData = data->vertexData + data->vertexBytes;
+    data->mapping = p;
+    data->mappingBytes = bytes;
+    return data;
+}
+
+// Writes the mesh's cache file.  It is written to a temporary file first and
+// renamed, so a reader never sees a partly written cache.
+static bool saveMeshCache(int meshNumber, const MeshData* data, uint64_t checksum, uint64_t sourceBytes)
+{
+    char path[256], tmpPath[300];
+    meshCachePath(meshNumber, path);
+    sprintf(tmpPath, "%s.%d.tmp", path, (int)getpid());
+
+    MeshCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, meshCacheMagic, 4);
+    h.version = meshCacheVersion;
+    h.sourceChecksum = checksum;
+    h.sourceBytes = sourceBytes;
+    h.vertexFormat = data->vertexFormat;
+    h.numVertices = data->numVertices;
+    h.numIndices = data->numIndices;
+    h.indexType = data->indexType;
+    h.vertexBytes = data->vertexBytes;
+    h.indexBytes = data->indexBytes;
+    h.numLods = data->numLods;
+    memcpy(h.lods, data->lods, sizeof(h.lods));
+
+    FILE* f = fopen(tmpPath, "wb");
+    if (f == NULL) return false;
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+           && fwrite(data->vertexData, 1, data->vertexBytes, f) == data->vertexBytes
+           && fwrite(data->indexData, 1, data->indexBytes, f) == data->indexBytes;
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok) ok = rename(tmpPath, path) == 0;
+    if (!ok) remove(tmpPath);
+    return ok;
+}
+
+// Assimp's default logger, attached by aiInit, is shared by every import and
+// nothing says it is thread safe, so the loader threads import one at a time.
+mutex assimpMutex;
+
+// As loadMesh in gnatidread.h, but returning the whole scene so that it can be
+// released with releaseMesh once its mesh has been turned into MeshData.
+static const aiScene* importMesh(int meshNumber)
+{
+    char path[256];
+    meshSourcePath(meshNumber, path);
+
+    lock_guard<mutex> lock(assimpMutex);
+    const aiScene* scene = aiImportFile(path, aiProcessPreset_TargetRealtime_Quality
+                                              | aiProcess_ConvertToLeftHanded);
+    if (scene == NULL || scene->mNumMeshes == 0) {
+        printf("Error - could not load %s: %s\n", path, aiGetErrorString());
+        exit(1);
+    }
+    return scene;
+}
+
+static void releaseMesh(const aiScene* scene)
+{
+    lock_guard<mutex> lock(assimpMutex);
+    aiReleaseImport(scene);
+}
+
+// Gets the MeshData for a mesh: from the cache when it's up to date, otherwise
+// via Assimp, saving a new cache.  Safe to call from the loader threads.
+static MeshData* loadMeshData(int meshNumber)
+{
+    char source[256];
+    meshSourcePath(meshNumber, source);
+
+    uint64_t checksum = 0, sourceBytes = 0;
+    bool cacheable = useMeshCache && checksumFile(source, &checksum, &sourceBytes);
+
+    if (cacheable) {
+        MeshData* cached = loadMeshCache(meshNumber, checksum, sourceBytes);
+        if (cached != NULL) return cached;
+    }
+
+    const aiScene* scene = importMesh(meshNumber);
+    MeshData* data = buildMeshData(scene->mMeshes[0]);
+    releaseMesh(scene); // Only the MeshData is kept
+    if (cacheable) saveMeshCache(meshNumber, data, checksum, sourceBytes);
+    return data;
+}
+
+// Builds the cache for every model in the models-textures directory (-bakemeshes).
+static void bakeMeshCaches()
+{
+    aiInit();
+
+    int baked = 0;
+    double totalMs = 0, totalBefore = 0, totalAfter = 0, totalTriangles = 0;
+    unsigned long totalBytes = 0;
+
+    for (int m=0; m < numMeshes; m++) {
+        char source[256];
+        meshSourcePath(m, source);
+
+        uint64_t checksum, sourceBytes;
+        if (!checksumFile(source, &checksum, &sourceBytes)) continue;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        const aiScene* scene = importMesh(m);
+        MeshData* data = buildMeshData(scene->mMeshes[0]);
+        releaseMesh(scene);
+        chrono::duration<double, milli> parseTime = chrono::steady_clock::now() - start;
+
+        bool saved = saveMeshCache(m, data, checksum, sourceBytes);
+        char lodTriangles[64] = "";
+        for (int l=0; l < data->numLods; l++)
+            sprintf(lodTriangles + strlen(lodTriangles), "%s%u", l ? "/" : "", data->lods[l].count/3);
+        printf("model%d.x: %u vertices, %s triangles, ACMR %.3f -> %.3f, %lu cache bytes,"
+               " %.1f ms in Assimp and optimising%s\n",
+               m, data->numVertices, lodTriangles, data->acmrBefore, data->acmrAfter,
+               (unsigned long)(sizeof(MeshCacheHeader) + data->vertexBytes + data->indexBytes),
+               parseTime.count(), saved ? "" : " - could not write the cache");
+        totalBefore += data->acmrBefore * data->lods[0].count / 3;
+        totalAfter += data->acmrAfter * data->lods[0].count / 3;
+        totalTriangles += data->lods[0].count / 3;
+
+        if (saved) baked++;
+        totalMs += parseTime.count();
+        totalBytes += data->vertexBytes + data->indexBytes;
+        freeMeshData(data);
+    }
+
+    printf("Baked %d meshes (%lu bytes), saving about %.0f ms of Assimp parsing and optimising per cold start\n",
+           baked, totalBytes, totalMs);
+    if (totalTriangles > 0)
+        printf("Vertices shaded per triangle with a %d vertex FIFO cache: %.3f before optimising, %.3f after\n",
+               fifoCacheSize, totalBefore / totalTriangles, totalAfter / totalTriangles);
+}
+
+//----------------------------------------------------------------------------
+
+void loadMeshIfNotAlreadyLoaded(int meshNumber)
+{
+    checkMeshNumber(meshNumber);
+
+    if (meshLoadStates[meshNumber] == LOADED)
+        return; // Already loaded
+
+    uploadMesh(meshNumber, loadMeshData(meshNumber));
+}
+
+//------Texture loading-------------------------------------------------------
+//
+// Textures go through the same two steps as meshes.  buildTextureData takes a
+// bitmap decoded by loadTextureNum and bakes its whole mip chain on the CPU,
+// optionally compressed to BC1 (-compresstextures, 6:1 against GL_RGB8 and
+// 8:1 against the RGBA8 most drivers really store).  uploadTexture then
+// uploads the levels one by one, so nothing is left for glGenerateMipmap.
+// Baked textures are cached as texture<n>.tex, in the same way as the mesh
+// cache; -baketextures bakes every texture up front and reports the savings.
+
+enum TextureFormat { TEXTURE_RGB8 = 0, TEXTURE_BC1 = 1 };
+
+bool compressTextures = false; // Set by -compresstextures, cleared if unsupported (see init)
+bool useTextureCache = true;   // Cleared by -notexcache
+
+const int maxTextureLevels = 16; // Enough for 32768 x 32768
+
+typedef struct {
+    uint32_t width, height;
+    uint64_t offset, bytes; // Position of the level within the level data
+} TextureLevel;
+
+typedef struct {
+    int format; // TextureFormat
+    int numLevels;
+    TextureLevel levels[maxTextureLevels];
+    const unsigned char* data; // All the levels, largest first
+
+    // The level data lives either in storage or in a mapping of a cache file
+    vector<unsigned char> storage;
+    void* mapping;
+    size_t mappingBytes;
+} TextureData;
+
+// Halves an RGB image (rounding down, but never below 1) with a box filter.
+// When a side is odd its last row or column is dropped, and a side of 1 is
+// averaged with itself.
+static void downsampleRGB(const unsigned char* src, int w, int h, unsigned char* dst, int dw, int dh)
+{
+    for (int y=0; y < dh; y++)
+        for (int x=0; x < dw; x++) {
+            int x0 = min(2*x, w-1), x1 = min(2*x+1, w-1);
+            int y0 = min(2*y, h-1), y1 = min(2*y+1, h-1);
+            for (int c=0; c < 3; c++) {
+                int sum = src[(y0*w + x0)*3 + c] + src[(y0*w + x1)*3 + c]
+                        + src[(y1*w + x0)*3 + c] + src[(y1*w + x1)*3 + c];
+                dst[(y*dw + x)*3 + c] = (sum + 2) / 4;
+            }
+        }
+}
+
+static GLushort packRGB565(const int rgb[3])
+{
+    return ((rgb[0]*31 + 127)/255 << 11) | ((rgb[1]*63 + 127)/255 << 5) | ((rgb[2]*31 + 127)/255);
+}
+
+static void unpackRGB565(GLushort c, int rgb[3])
+{
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Compresses a 4x4 block of RGB pixels to 8 bytes of BC1.  The endpoints are
+// the extremes of the block's colours along their principal axis (found by
+// power iteration on the covariance), inset slightly, and each pixel takes
+// the nearest of the four palette colours.
+static void compressBC1Block(const unsigned char pixels[16][3], unsigned char out[8])
+{
+    float mean[3] = { 0, 0, 0 };
+    for (int p=0; p < 16; p++)
+        for (int c=0; c < 3; c++) mean[c] += pixels[p][c] / 16.0f;
+
+    float cov[3][3] = { { 0 } };
+    for (int p=0; p < 16; p++)
+        for (int i=0; i < 3; i++)
+            for (int j=0; j < 3; j++)
+                cov[i][j] += (pixels[p][i] - mean[i]) * (pixels[p][j] - mean[j]);
+
+    float axis[3] = { 1, 1, 1 };
+    for (int iter=0; iter < 8; iter++) {
+        float next[3], len = 0;
+        for (int i=0; i < 3; i++) {
+            next[i] = cov[i][0]*axis[0] + cov[i][1]*axis[1] + cov[i][2]*axis[2];
+            len += next[i]*next[i];
+        }
+        if (len < 1e-12f) break; // A flat block - any axis will do
+        len = sqrt(len);
+        for (int i=0; i < 3; i++) axis[i] = next[i] / len;
+    }
+
+    float tMin = 1e30f, tMax = -1e30f;
+    for (int p=0; p < 16; p++) {
+        float t = 0;
+        for (int c=0; c < 3; c++) t += (pixels[p][c] - mean[c]) * axis[c];
+        tMin = min(tMin, t);
+        tMax = max(tMax, t);
+    }
+    float inset = (tMax - tMin) / 16;
+    tMin += inset;
+    tMax -= inset;
+
+    int lo[3], hi[3];
+    for (int c=0; c < 3; c++) {
+        lo[c] = max(0, min(255, (int)floor(mean[c] + tMin*axis[c] + 0.5f)));
+        hi[c] = max(0, min(255, (int)floor(mean[c] + tMax*axis[c] + 0.5f)));
+    }
+
+    GLushort c0 = packRGB565(hi), c1 = packRGB565(lo);
+    if (c0 < c1) { GLushort t = c0; c0 = c1; c1 = t; }
+
+    // With c0 > c1 the block uses the four colour mode; with c0 == c1 every
+    // pixel is c0 anyway.
+    int palette[4][3];
+    unpackRGB565(c0, palette[0]);
+    unpackRGB565(c1, palette[1]);
+    for (int c=0; c < 3; c++) {
+        palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+    }
+
+    GLuint indices = 0;
+    for (int p=0; p < 16; p++) {
+        int best = 0, bestDist = 1 << 30;
+        for (int i=0; i < 4; i++) {
+            int dist = 0;
+            for (int c=0; c < 3; c++) {
+                int d = pixels[p][c] - palette[i][c];
+                dist += d*d;
+            }
+            if (dist < bestDist) { bestDist = dist; best = i; }
+        }
+        indices |= (GLuint)best << (2*p);
+    }
+
+    out[0] = c0 & 0xff; out[1] = c0 >> 8;
+    out[2] = c1 & 0xff; out[3] = c1 >> 8;
+    for (int i=0; i < 4; i++) out[4+i] = (indices >> (8*i)) & 0xff;
+}
+
+static size_t bc1Bytes(int w, int h)
+{
+    return (size_t)((w+3)/4) * ((h+3)/4) * 8;
+}
+
+// Compresses a whole RGB image to BC1.  Blocks hanging over the edge repeat
+// the last row and column.
+static void compressBC1(const unsigned char* rgb, int w, int h, unsigned char* out)
+{
+    unsigned char block[16][3];
+    for (int by=0; by < (h+3)/4; by++)
+        for (int bx=0; bx < (w+3)/4; bx++) {
+            for (int p=0; p < 16; p++) {
+                int x = min(bx*4 + p%4, w-1), y = min(by*4 + p/4, h-1);
+                memcpy(block[p], &rgb[(y*w + x)*3], 3);
+            }
+            compressBC1Block(block, out);
+            out += 8;
+        }
+}
+
+// Bakes the mip chain of a decoded bitmap in the current texture format.
+static TextureData* buildTextureData(const texture* tex)
+{
+    TextureData* data = new TextureData();
+    data->format = compressTextures ? TEXTURE_BC1 : TEXTURE_RGB8;
+    data->mapping = NULL;
+    data->mappingBytes = 0;
+
+    // The bitmap rows are 4 byte aligned, as glTexImage2D expected; the
+    // levels built here are tightly packed.
+    int w = tex->width, h = tex->height;
+    size_t srcStride = (w*3 + 3) & ~3;
+    vector<unsigned char> level(w*h*3), next;
+    for (int y=0; y < h; y++)
+        memcpy(&level[y*w*3], tex->rgbData + y*srcStride, w*3);
+
+    size_t offset = 0;
+    for (data->numLevels=0; data->numLevels < maxTextureLevels; ) {
+        TextureLevel& l = data->levels[data->numLevels++];
+        l.width = w;
+        l.height = h;
+        l.offset = offset;
+        l.bytes = (data->format == TEXTURE_BC1) ? bc1Bytes(w, h) : (size_t)w*h*3;
+
+        data->storage.resize(offset + l.bytes);
+        if (data->format == TEXTURE_BC1) compressBC1(&level[0], w, h, &data->storage[offset]);
+        else memcpy(&data->storage[offset], &level[0], l.bytes);
+        offset += l.bytes;
+
+        if (w == 1 && h == 1) break;
+        int nw = max(1, w/2), nh = max(1, h/2);
+        next.resize(nw*nh*3);
+        downsampleRGB(&level[0], w, h, &next[0], nw, nh);
+        level.swap(next);
+        w = nw;
+        h = nh;
+    }
+
+    data->data = &data->storage[0];
+    return data;
+}
+
+static void freeTextureData(TextureData* data)
+{
+    if (data->mapping != NULL) munmap(data->mapping, data->mappingBytes);
+    delete data;
+}
+
+// Whether every texel of a baked texture is white.  Only the first level is
+// checked, since the smaller ones are averages of it.
+static bool isWhiteTexture(const TextureData* data)
+{
+    const TextureLevel& level = data->levels[0];
+    const unsigned char* p = data->data + level.offset;
+    if (data->format == TEXTURE_BC1) {
+        // Both endpoints must be white, which selects three colour mode, where
+        // index 3 is black rather than a fourth colour
+        for (uint64_t b=0; b < level.bytes; b += 8) {
+            if (p[b] != 0xff || p[b+1] != 0xff || p[b+2] != 0xff || p[b+3] != 0xff) return false;
+            for (int i=4; i < 8; i++)
+                if (p[b+i] & (p[b+i] >> 1) & 0x55) return false;
+        }
+        return true;
+    }
+
+    for (uint64_t i=0; i < level.bytes; i++)
+        if (p[i] != 0xff) return false;
+    return true;
+}
+
+// Uploads every level of a baked texture into textureIDs[i], then frees the
+// TextureData.  Must be called on the GL thread.
+static void uploadTexture(int i, TextureData* data)
+{
+    // Based on: http://www.opengl.org/wiki/Common_Mistakes
+    bindTexture(textureIDs[i]); CheckError();
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Levels are tightly packed
+    for (int l=0; l < data->numLevels; l++) {
+        const TextureLevel& level = data->levels[l];
+        const unsigned char* pixels = data->data + level.offset;
+        if (data->format == TEXTURE_BC1)
+            glCompressedTexImage2D(GL_TEXTURE_2D, l, GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+                                   level.width, level.height, 0, level.bytes, pixels);
+        else
+            glTexImage2D(GL_TEXTURE_2D, l, GL_RGB, level.width, level.height,
+                         0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        CheckError();
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, data->numLevels-1); CheckError();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT); CheckError();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT); CheckError();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); CheckError();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); CheckError();
+
+    bindTexture(0); CheckError(); // Back to default texture
+
+    textureLoadStates[i] = LOADED;
+    textureIsWhite[i] = isWhiteTexture(data);
+    freeTextureData(data);
+}
+
+//------Texture cache---------------------------------------------------------
+//
+// texture<n>.tex holds a TextureCacheHeader followed by the level data.  As
+// with the mesh cache it is mmap'd, and rebuilt when the checksum of the .bmp
+// or the texture format doesn't match.
+
+const char textureCacheMagic[4] = { 'T', 'E', 'X', 'C' };
+const uint32_t textureCacheVersion = 1;
+
+typedef struct {
+    char magic[4];            // textureCacheMagic
+    uint32_t version;         // textureCacheVersion
+    uint64_t sourceChecksum;  // checksumFile of the .bmp file
+    uint64_t sourceBytes;
+    uint32_t format, numLevels;
+    TextureLevel levels[maxTextureLevels];
+} TextureCacheHeader;
+
+static void textureSourcePath(int texNumber, char* path)
+{
+    sprintf(path, "%s/texture%d.bmp", dataDir, texNumber);
+}
+
+static void textureCachePath(int texNumber, char* path)
+{
+    sprintf(path, "%s/texture%d.tex", dataDir, texNumber);
+}
+
+static size_t textureDataBytes(const TextureData* data)
+{
+    const TextureLevel& last = data->levels[data->numLevels-1];
+    return last.offset + last.bytes;
+}
+
+// Returns TextureData pointing into a mapping of the texture's cache file, or
+// NULL if there is no valid cache for this version of the source and format.
+static TextureData* loadTextureCache(int texNumber, uint64_t checksum, uint64_t sourceBytes)
+{
+    char path[256];
+    textureCachePath(texNumber, path);
+
+    size_t bytes;
+    unsigned char* p = (unsigned char*)mapFile(path, &bytes);
+    if (p == NULL) return NULL;
+
+    const TextureCacheHeader* h = (const TextureCacheHeader*)p;
+    int format = compressTextures ? TEXTURE_BC1 : TEXTURE_RGB8;
+    bool valid = bytes >= sizeof(TextureCacheHeader)
+        && memcmp(h->magic, textureCacheMagic, 4) == 0 && h->version == textureCacheVersion
+        && h->sourceChecksum == checksum && h->sourceBytes == sourceBytes
+        && h->format == (uint32_t)format
+        && h->numLevels >= 1 && h->numLevels <= (uint32_t)maxTextureLevels;
+
+    // Each level must follow the one before and have the size its dimensions
+    // imply, so that a stale or hand-made cache can't make the upload read
+    // outside the mapping
+    uint64_t end = 0;
+    for (uint32_t l=0; valid && l < h->numLevels; l++) {
+        const TextureLevel& level = h->levels[l];
+        valid = level.width >= 1 && level.width <= 32768 && level.height >= 1 && level.height <= 32768
+            && level.offset == end
+            && level.bytes == (h->format == TEXTURE_BC1 ? bc1Bytes(level.width, level.height)
+                                                        : (uint64_t)level.width * level.height * 3);
+        end = level.offset + level.bytes;
+    }
+    valid = valid && sizeof(TextureCacheHeader) + end == bytes;
+    if (!valid) {
+        munmap(p, bytes);
+        return NULL;
+    }
+
+    TextureData* data = new TextureData();
+    data->format = h->format;
+    data->numLevels = h->numLevels;
+    memcpy(data->levels, h->levels, sizeof(data->levels));
+    data->data = p + sizeof(TextureCacheHeader);
+    data->mapping = p;
+    data->mappingBytes = bytes;
+    return data;
+}
+
+// Writes the texture's cache file, via a temporary file like saveMeshCache.
+static bool saveTextureCache(int texNumber, const TextureData* data, uint64_t checksum, uint64_t sourceBytes)
+{
+    char path[256], tmpPath[300];
+    textureCachePath(texNumber, path);
+    sprintf(tmpPath, "%s.%d.tmp", path, (int)getpid());
+
+    TextureCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, textureCacheMagic, 4);
+    h.version = textureCacheVersion;
+    h.sourceChecksum = checksum;
+    h.sourceBytes = sourceBytes;
+    h.format = data->format;
+    h.numLevels = data->numLevels;
+    memcpy(h.levels, data->levels, sizeof(h.levels));
+
+    FILE* f = fopen(tmpPath, "wb");
+    if (f == NULL) return false;
+
+    size_t bytes = textureDataBytes(data);
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(data->data, 1, bytes, f) == bytes;
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok) ok = rename(tmpPath, path) == 0;
+    if (!ok) remove(tmpPath);
+    return ok;
+}
+
+// The bitmap loader isn't known to be thread safe either, so bitmaps are also
+// decoded one at a time.
+mutex bitmapMutex;
+
+static texture* importTexture(int texNumber)
+{
+    lock_guard<mutex> lock(bitmapMutex);
+    return loadTextureNum(texNumber);
+}
+
+// Frees a bitmap from importTexture.  gnatidread.h allocates both the texture
+// and its rgbData with malloc.
+static void freeTexture(texture* tex)
+{
+    free(tex->rgbData);
+    free(tex);
+}
+
+// Gets the baked TextureData for a texture: from the cache when it's up to
+// date, otherwise by decoding and baking the bitmap, saving a new cache.
+// Safe to call from the loader threads.
+static TextureData* loadTextureData(int texNumber)
+{
+    char source[256];
+    textureSourcePath(texNumber, source);
+
+    uint64_t checksum = 0, sourceBytes = 0;
+    bool cacheable = useTextureCache && checksumFile(source, &checksum, &sourceBytes);
+
+    if (cacheable) {
+        TextureData* cached = loadTextureCache(texNumber, checksum, sourceBytes);
+        if (cached != NULL) return cached;
+    }
+
+    texture* tex = importTexture(texNumber);
+    TextureData* data = buildTextureData(tex);
+    freeTexture(tex); // Only the TextureData is kept
+    if (cacheable) saveTextureCache(texNumber, data, checksum, sourceBytes);
+    return data;
+}
+
+// Bakes the cache for every texture in the models-textures directory
+// (-baketextures) and compares it with loading the bitmaps directly.
+static void bakeTextureCaches()
+{
+    int baked = 0;
+    double totalBuildMs = 0, totalCacheMs = 0;
+    unsigned long totalRawBytes = 0, totalCacheBytes = 0;
+
+    for (int t=0; t < numTextures; t++) {
+        char source[256];
+        textureSourcePath(t, source);
+
+        uint64_t checksum, sourceBytes;
+        if (!checksumFile(source, &checksum, &sourceBytes)) continue;
+
+        // Decoding and baking, which the cache saves at load time
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        texture* tex = importTexture(t);
+        TextureData* data = buildTextureData(tex);
+        chrono::duration<double, milli> buildTime = chrono::steady_clock::now() - start;
+
+        bool saved = saveTextureCache(t, data, checksum, sourceBytes);
+
+        // Loading it back from the cache, including the checksum of the source
+        start = chrono::steady_clock::now();
+        TextureData* cached = NULL;
+        if (saved && checksumFile(source, &checksum, &sourceBytes))
+            cached = loadTextureCache(t, checksum, sourceBytes);
+        chrono::duration<double, milli> cacheTime = chrono::steady_clock::now() - start;
+
+        // Uncompressed, the GPU holds RGBA8 for the base level plus about a
+        // third more for the mipmaps glGenerateMipmap used to build
+        unsigned long rawBytes = (unsigned long)tex->width * tex->height * 4 * 4 / 3;
+        unsigned long cacheBytes = textureDataBytes(data);
+
+        printf("texture%d.bmp: %d x %d, %d levels, %lu bytes -> %lu bytes, "
+               "%.1f ms to decode and bake, %.1f ms from the cache%s\n",
+               t, tex->width, tex->height, data->numLevels, rawBytes, cacheBytes,
+               buildTime.count(), cacheTime.count(),
+               cached != NULL ? "" : " - could not write the cache");
+
+        if (cached != NULL) {
+            baked++;
+            totalBuildMs += buildTime.count();
+            totalCacheMs += cacheTime.count();
+            totalRawBytes += rawBytes;
+            totalCacheBytes += cacheBytes;
+            freeTextureData(cached);
+        }
+        freeTextureData(data);
+        freeTexture(tex);
+    }
+
+    printf("Baked %d textures in %s: %lu bytes -> %lu bytes of texture memory, "
+           "%.0f ms -> %.0f ms to load\n",
+           baked, compressTextures ? "BC1" : "RGB8", totalRawBytes, totalCacheBytes,
+           totalBuildMs, totalCacheMs);
+}
+
+//----------------------------------------------------------------------------
+
+// Loads a texture by number, and binds it for later use.    
+void loadTextureIfNotAlreadyLoaded(int i)
+{
+    if (textureLoadStates[i] == LOADED) return; // The texture is already loaded.
+
+    uploadTexture(i, loadTextureData(i)); CheckError();
+}
+
+//------Placeholders----------------------------------------------------------
+//
+// A plain white texture and a cube with sides of length 2, drawn in place of
+// textures and meshes that are still being loaded in the background.
+
+// The placeholder cube spans -1 to 1 on each axis.
+static void setPlaceholderBounds()
+{
+    meshBounds[placeholderMesh].center = vec3(0.0, 0.0, 0.0);
+    meshBounds[placeholderMesh].halfSize = vec3(1.0, 1.0, 1.0);
+    meshBounds[placeholderMesh].radius = sqrt(3.0);
+}
+
+static void createPlaceholders()
+{
+    GLubyte white[3] = { 255, 255, 255 };
+    bindTexture(textureIDs[placeholderTexture]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, white);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    bindTexture(0); CheckError();
+    textureIsWhite[placeholderTexture] = true;
+
+    // Four vertices per face, stored planar like uploadPlanarVertices
+    GLfloat positions[24*3], texCoords[24*3], normals[24*3];
+    GLushort elements[36];
+    GLfloat corners[4][2] = { {-1,-1}, {1,-1}, {1,1}, {-1,1} };
+
+    for (int f=0; f < 6; f++) {
+        int axis = f/2, u = (axis+1)%3, v = (axis+2)%3;
+        float sign = (f%2 == 0) ? 1.0 : -1.0;
+
+        for (int c=0; c < 4; c++) {
+            int vert = f*4 + c;
+            GLfloat* p = &positions[vert*3];
+            GLfloat* n = &normals[vert*3];
+            p[axis] = sign; p[u] = corners[c][0]; p[v] = corners[c][1];
+            n[axis] = sign; n[u] = 0.0; n[v] = 0.0;
+            texCoords[vert*3] = (corners[c][0]+1)/2;
+            texCoords[vert*3+1] = (corners[c][1]+1)/2;
+            texCoords[vert*3+2] = 0.0;
+        }
+
+        // Counter-clockwise when seen from outside the cube
+        int quad[6] = { 0, 1, 2, 0, 2, 3 };
+        for (int i=0; i < 6; i++)
+            elements[f*6 + i] = f*4 + (sign > 0 ? quad[i] : quad[5-i]);
+    }
+
+    bindVertexArray( vaoIDs[placeholderMesh] );
+
+    GLuint buffer[2];
+    glGenBuffers( 2, buffer );
+    glBindBuffer( GL_ARRAY_BUFFER, buffer[0] );
+    glBufferData( GL_ARRAY_BUFFER, sizeof(positions)*3, NULL, GL_STATIC_DRAW );
+    glBufferSubData( GL_ARRAY_BUFFER, 0, sizeof(positions), positions );
+    glBufferSubData( GL_ARRAY_BUFFER, sizeof(positions), sizeof(texCoords), texCoords );
+    glBufferSubData( GL_ARRAY_BUFFER, 2*sizeof(positions), sizeof(normals), normals );
+
+    glVertexAttribPointer( vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0) );
+    glEnableVertexAttribArray( vPosition );
+    glVertexAttribPointer( vTexCoord, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(positions)) );
+    glEnableVertexAttribArray( vTexCoord );
+    glVertexAttribPointer( vNormal, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(2*sizeof(positions)) );
+    glEnableVertexAttribArray( vNormal );
+
+    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, buffer[1] );
+    glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(elements), elements, GL_STATIC_DRAW );
+    indexTypes[placeholderMesh] = GL_UNSIGNED_SHORT;
+    meshLods[placeholderMesh] = 1;
+    lodRanges[placeholderMesh][0].first = 0;
+    lodRanges[placeholderMesh][0].count = 36;
+    CheckError();
+
+    setPlaceholderBounds();
+}
+
+//------Background loading----------------------------------------------------
+//
+// Meshes and textures are parsed and decoded by a pool of loader threads, so
+// the display callback never waits for Assimp or bitmap decoding.  meshReady
+// and textureReady start a load the first time they're asked about it; the
+// finished CPU data comes back through finishedLoads and is uploaded on the GL
+// thread by uploadFinishedLoads, a few each frame within uploadBudgetMs.  Until
+// then objects are drawn with the placeholders.  With -syncload everything is
+// instead loaded on first use, as before.
+
+bool syncLoading = false; // Set by -syncload
+const int numLoaderThreads = 2;
+const double uploadBudgetMs = 4.0; // GL upload time allowed per frame
+
+
+typedef struct {
+    bool isMesh;
+    int id;        // Mesh or texture number
+    MeshData* mesh; // Filled in by the loader thread
+    TextureData* tex;
+} LoadJob;
+
+mutex loadMutex; // Guards pendingLoads, finishedLoads and stopLoaders
+condition_variable loadCond;
+deque<LoadJob> pendingLoads, finishedLoads;
+bool stopLoaders = false;
+vector<thread> loaderThreads;
+
+static void loaderThreadMain()
+{
+    for (;;) {
+        LoadJob job;
+        {
+            unique_lock<mutex> lock(loadMutex);
+            while (pendingLoads.empty() && !stopLoaders) loadCond.wait(lock);
+            if (stopLoaders) return;
+            job = pendingLoads.front();
+            pendingLoads.pop_front();
+        }
+
+        {
+            ProfileScope scope(job.isMesh ? "loadMeshData" : "loadTextureData");
+            if (job.isMesh) job.mesh = loadMeshData(job.id);
+            else job.tex = loadTextureData(job.id);
+        }
+
+        lock_guard<mutex> lock(loadMutex);
+        finishedLoads.push_back(job);
+    }
+}
+
+// Called at exit: the threads must be gone before loadMutex and loadCond are
+// destroyed, since destroying a condition variable with waiters can block.
+static void stopLoaderThreads()
+{
+    {
+        lock_guard<mutex> lock(loadMutex);
+        stopLoaders = true;
+    }
+    loadCond.notify_all();
+    for (size_t i=0; i < loaderThreads.size(); i++)
+        loaderThreads[i].join();
+}
+
+static void queueLoad(bool isMesh, int id)
+{
+    if (loaderThreads.empty()) {
+        for (int i=0; i < numLoaderThreads; i++)
+            loaderThreads.push_back(thread(loaderThreadMain));
+        atexit(stopLoaderThreads);
+    }
+
+    LoadJob job = { isMesh, id, NULL, NULL };
+    {
+        lock_guard<mutex> lock(loadMutex);
+        pendingLoads.push_back(job);
+    }
+    loadCond.notify_one();
+}
+
+// Returns true if the mesh can be drawn, otherwise starts loading it.
+static bool meshReady(int meshNumber)
+{
+    checkMeshNumber(meshNumber);
+    if (meshLoadStates[meshNumber] == LOADED) return true;
+
+    if (syncLoading) {
+        loadMeshIfNotAlreadyLoaded(meshNumber);
+        return true;
+    }
+    if (meshLoadStates[meshNumber] == NOT_REQUESTED) {
+        meshLoadStates[meshNumber] = LOADING;
+        queueLoad(true, meshNumber);
+    }
+    return false;
+}
+
+// Returns true if the texture can be used, otherwise starts loading it.
+static bool textureReady(int texNumber)
+{
+    if (textureLoadStates[texNumber] == LOADED) return true;
+
+    if (syncLoading) {
+        loadTextureIfNotAlreadyLoaded(texNumber);
+        return true;
+    }
+    if (textureLoadStates[texNumber] == NOT_REQUESTED) {
+        textureLoadStates[texNumber] = LOADING;
+        queueLoad(false, texNumber);
+    }
+    return false;
+}
+
+// Uploads finished loads to GL, stopping once uploadBudgetMs has been used.
+// At least one is uploaded per call so that loading always makes progress.
+static void uploadFinishedLoads()
+{
+    ProfileScope scope("uploadFinishedLoads");
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    for (;;) {
+        LoadJob job;
+        {
+            lock_guard<mutex> lock(loadMutex);
+            if (finishedLoads.empty()) return;
+            job = finishedLoads.front();
+            finishedLoads.pop_front();
+        }
+
+        if (job.isMesh)
+            uploadMesh(job.id, job.mesh);
+        else
+            uploadTexture(job.id, job.tex);
+
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        if (elapsed.count() > uploadBudgetMs) return;
+    }
+}
+
+// True while any mesh or texture load has been started but not yet uploaded.
+static bool loadsInFlight()
+{
+    for (int m=0; m < numMeshes; m++)
+        if (meshLoadStates[m] == LOADING) return true;
+    for (int t=0; t < numTextures; t++)
+        if (textureLoadStates[t] == LOADING) return true;
+    return false;
+}
+
+// Waits until every load that has been started is uploaded.
+static void waitForLoads()
+{
+    for (;;) {
+        uploadFinishedLoads();
+        if (!loadsInFlight()) return;
+
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+//----------------------------------------------------------------------------
+
+static int pickObject(int x, int y);
+static void select_object(int id);
+
+static void mouseClickOrScroll(int button, int state, int x, int y)
+{
+
+    if (button==GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+        // Select the object clicked on, if any, so the current tool acts on it
+        int picked = pickObject(x, y);
+        if (picked >= 0) select_object(picked + 200);
+
+        if (glutGetModifiers()!=GLUT_ACTIVE_SHIFT) activateTool(button);
+        else activateTool(GLUT_LEFT_BUTTON);
+
+    }
+
+    else if (button==GLUT_LEFT_BUTTON && state == GLUT_UP) deactivateTool();
+
+    else if (button==GLUT_MIDDLE_BUTTON && state==GLUT_DOWN) { 
+        activateTool(button);
+    }
+
+    else if (button==GLUT_MIDDLE_BUTTON && state==GLUT_UP) deactivateTool();
+
+    else if (button == 3) { // scroll up
+        viewDist = (viewDist < 0.0 ? viewDist : viewDist*0.8) - 0.05;
+    }
+
+    else if (button == 4) { // scroll down
+        viewDist = (viewDist < 0.0 ? viewDist : viewDist*1.25) + 0.05;
+    }
+
+    postRedisplay();
+}
+
+// Dragging with a button down runs the active tool's callbacks.
+static void mouseDrag(int x, int y)
+{
+    doToolUpdateXY(x, y);
+    postRedisplay();
+}
+
+//----------------------------------------------------------------------------
+void myLeftClickFunc(int button, int state, int x, int y){}
+
+//----------------------------------------------------------------------------
+
+static void mousePassiveMotion(int x, int y)
+{
+    mouseX=x;
+    mouseY=y;
+}
+
+//----------------------------------------------------------------------------
+
+mat2 camRotZ()
+{
+    return rotZ(-camRotSidewaysDeg) * mat2(10.0, 0, 0, -10.0);
+}
+
+//------callback functions for doRotate below and later-----------------------
+
+static void adjustCamrotsideViewdist(vec2 cv)
+{
+    cout << cv << endl;
+    camRotSidewaysDeg+=cv[0]; viewDist+=cv[1];
+}
+
+static void adjustcamSideUp(vec2 su)
+{
+    camRotSidewaysDeg+=su[0]; camRotUpAndOverDeg+=su[1];
+}
+    
+static void adjustLocXZ(vec2 xz)
+{
+    scene.loc[toolObj][0]+=xz[0]; scene.loc[toolObj][2]+=xz[1];
+    markMoved(toolObj);
+}
+
+static void adjustScaleY(vec2 sy)
+{
+    scene.scale[toolObj]+=sy[0]; scene.loc[toolObj][1]+=sy[1];
+    markMoved(toolObj);
+}
+
+
+//----------------------------------------------------------------------------
+//------Set the mouse buttons to rotate the camera----------------------------
+//------around the centre of the scene.---------------------------------------
+//----------------------------------------------------------------------------
+
+static void doRotate()
+{
+    setToolCallbacks(adjustCamrotsideViewdist, mat2(400,0,0,-2),
+                     adjustcamSideUp, mat2(400, 0, 0,-90) );
+}
+                                     
+//------Scene store-----------------------------------------------------------
+//
+// Objects are only ever added and removed through these, so that every array
+// in scene stays the same length (nObjects).
+
+// Appends an object to the scene and returns its number.  Its fields are
+// zero, other than loc's w, until the caller sets them, and its model matrix
+// is marked dirty.
+static int newSceneObject()
+{
+    scene.loc.push_back(vec4(0.0, 0.0, 0.0, 1.0));
+    scene.scale.push_back(0.0);
+    scene.angles.push_back(vec3(0.0, 0.0, 0.0));
+    scene.material.push_back(Material());
+    scene.meshId.push_back(0);
+    scene.texId.push_back(0);
+    scene.lightType.push_back(LIGHT_NONE);
+    scene.lod.push_back(0);
+    scene.model.push_back(ModelMatrix());
+    scene.modelDirty.push_back(1);
+    bvhStale = true;
+    return nObjects++;
+}
+
+// Copies every field of object from to object to.
+static void copySceneObject(int to, int from)
+{
+    scene.loc[to] = scene.loc[from];
+    scene.scale[to] = scene.scale[from];
+    scene.angles[to] = scene.angles[from];
+    scene.material[to] = scene.material[from];
+    scene.meshId[to] = scene.meshId[from];
+    scene.texId[to] = scene.texId[from];
+    scene.lightType[to] = scene.lightType[from];
+    scene.lod[to] = scene.lod[from];
+    scene.model[to] = scene.model[from];
+    scene.modelDirty[to] = scene.modelDirty[from];
+}
+
+// Removes an object, moving the later objects down one place.  The moved
+// objects are marked dirty, since their entries in modelViews now belong to
+// the object before them.
+static void eraseSceneObject(int obj)
+{
+    scene.loc.erase(scene.loc.begin() + obj);
+    scene.scale.erase(scene.scale.begin() + obj);
+    scene.angles.erase(scene.angles.begin() + obj);
+    scene.material.erase(scene.material.begin() + obj);
+    scene.meshId.erase(scene.meshId.begin() + obj);
+    scene.texId.erase(scene.texId.begin() + obj);
+    scene.lightType.erase(scene.lightType.begin() + obj);
+    scene.lod.erase(scene.lod.begin() + obj);
+    scene.model.erase(scene.model.begin() + obj);
+    scene.modelDirty.erase(scene.modelDirty.begin() + obj);
+    fill(scene.modelDirty.begin() + obj, scene.modelDirty.end(), 1);
+    bvhStale = true;
+    nObjects--;
+}
+
+// Removes every object, keeping the arrays' storage.  n is the number of
+// objects about to be added, if known, so the arrays only grow once.
+static void clearScene(int n)
+{
+    scene.loc.clear(); scene.loc.reserve(n);
+    scene.scale.clear(); scene.scale.reserve(n);
+    scene.angles.clear(); scene.angles.reserve(n);
+    scene.material.clear(); scene.material.reserve(n);
+    scene.meshId.clear(); scene.meshId.reserve(n);
+    scene.texId.clear(); scene.texId.reserve(n);
+    scene.lightType.clear(); scene.lightType.reserve(n);
+    scene.lod.clear(); scene.lod.reserve(n);
+    scene.model.clear(); scene.model.reserve(n);
+    scene.modelDirty.clear(); scene.modelDirty.reserve(n);
+    bvhStale = true;
+    nObjects = 0;
+}
+
+//------Add an object to the scene--------------------------------------------
+
+static void addObject(int id)
+{
+    int obj = newSceneObject();
+
+    vec2 currPos = currMouseXYworld(camRotSidewaysDeg);
+    scene.loc[obj] = vec4(currPos[0], 0.0, currPos[1], 1.0);
+
+    if (id!=0 && id!=55)
+        scene.scale[obj] = 0.005;
+
+    Material& m = scene.material[obj];
+    m.rgb = vec3(0.7, 0.7, 0.7); m.brightness = 1.0;
+    m.diffuse = 1.0; m.specular = 0.5;
+    m.ambient = 0.7; m.shine = 10.0;
+    m.texScale = 2.0;
+
+    scene.angles[obj] = vec3(0.0, 180.0, 0.0);
+
+    scene.meshId[obj] = id;
+    scene.texId[obj] = rand() % numTextures;
+    scene.lightType[obj] = LIGHT_NONE;
+
+    // Start loading the mesh and texture now rather than when first drawn
+    meshReady(id);
+    textureReady(scene.texId[obj]);
+
+    toolObj = currObject = obj;
+    setToolCallbacks(adjustLocXZ, camRotZ(),
+                     adjustScaleY, mat2(0.05, 0, 0, 10.0) );
+
+
+    postRedisplay();
+}
+
+//------Scene files-----------------------------------------------------------
+//
+// A scene (the camera and every object) can be saved with the 's' key or
+// the "Save Scene" menu entry, and loaded at startup with -scene instead of
+// the default scene.  The binary form is a SceneFileHeader followed by
+// numObjects fixed-size SceneRecords, which are read and written
+// sceneChunkRecords at a time, so load time is proportional to the file size
+// with nothing to parse.  Files saved with a .txt extension instead use a
+// text form with one object per line, which is handy for editing by hand;
+// loading tells the two apart by the magic number.
+
+const char sceneFileMagic[4] = { 'S', 'C', 'N', 'E' };
+const uint32_t sceneFileVersion = 1;
+const int sceneChunkRecords = 4096; // Records per fread/fwrite
+
+typedef struct {
+    char magic[4];         // sceneFileMagic
+    uint32_t version;      // sceneFileVersion
+    uint32_t recordBytes;  // sizeof(SceneRecord), so a changed layout is rejected
+    uint32_t numObjects;
+    float viewDist, camRotSidewaysDeg, camRotUpAndOverDeg;
+} SceneFileHeader;
+
+typedef struct {
+    float loc[3];
+    float scale;
+    float angles[3];
+    float ambient, diffuse, specular, shine;
+    float rgb[3];
+    float brightness;
+    float texScale;
+    int32_t meshId, texId, lightType;
+} SceneRecord;
+
+const char* sceneFileName = NULL;          // Set by -scene
+const char* saveSceneFileName = "scene.scn"; // Set by -savescene
+
+static bool isTextSceneFile(const char* fileName)
+{
+    size_t len = strlen(fileName);
+    return len >= 4 && strcmp(fileName + len - 4, ".txt") == 0;
+}
+
+static void sceneObjectToRecord(int obj, SceneRecord* r)
+{
+    const Material& m = scene.material[obj];
+    for (int i=0; i < 3; i++) {
+        r->loc[i] = scene.loc[obj][i];
+        r->angles[i] = scene.angles[obj][i];
+        r->rgb[i] = m.rgb[i];
+    }
+    r->scale = scene.scale[obj];
+    r->ambient = m.ambient; r->diffuse = m.diffuse;
+    r->specular = m.specular; r->shine = m.shine;
+    r->brightness = m.brightness;
+    r->texScale = m.texScale;
+    r->meshId = scene.meshId[obj]; r->texId = scene.texId[obj]; r->lightType = scene.lightType[obj];
+}
+
+// Appends the record's object to the scene.  Returns false, adding nothing, if
+// the record refers to a mesh, texture or light type that doesn't exist.
+static bool recordToSceneObject(const SceneRecord& r)
+{
+    if (r.meshId < 0 || r.meshId >= numMeshes || r.texId < 0 || r.texId >= numTextures
+        || r.lightType < LIGHT_NONE || r.lightType > LIGHT_SPOT)
+        return false;
+
+    int obj = newSceneObject();
+    Material& m = scene.material[obj];
+    scene.loc[obj] = vec4(r.loc[0], r.loc[1], r.loc[2], 1.0);
+    scene.angles[obj] = vec3(r.angles[0], r.angles[1], r.angles[2]);
+    scene.scale[obj] = r.scale;
+    m.rgb = vec3(r.rgb[0], r.rgb[1], r.rgb[2]);
+    m.ambient = r.ambient; m.diffuse = r.diffuse;
+    m.specular = r.specular; m.shine = r.shine;
+    m.brightness = r.brightness;
+    m.texScale = r.texScale;
+    scene.meshId[obj] = r.meshId; scene.texId[obj] = r.texId; scene.lightType[obj] = r.lightType;
+    return true;
+}
+
+static bool saveSceneBinary(FILE* f)
+{
+    SceneFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, sceneFileMagic, 4);
+    h.version = sceneFileVersion;
+    h.recordBytes = sizeof(SceneRecord);
+    h.numObjects = nObjects;
+    h.viewDist = viewDist;
+    h.camRotSidewaysDeg = camRotSidewaysDeg;
+    h.camRotUpAndOverDeg = camRotUpAndOverDeg;
+    if (fwrite(&h, sizeof(h), 1, f) != 1) return false;
+
+    vector<SceneRecord> chunk(sceneChunkRecords);
+    for (int first=0; first < nObjects; first += sceneChunkRecords) {
+        int n = min(sceneChunkRecords, nObjects - first);
+        for (int i=0; i < n; i++) sceneObjectToRecord(first+i, &chunk[i]);
+        if (fwrite(&chunk[0], sizeof(SceneRecord), n, f) != (size_t)n) return false;
+    }
+    return true;
+}
+
+// %.9g so that the floats survive the round trip exactly.
+static bool saveSceneText(FILE* f)
+{
+    fprintf(f, "scene %u\n", sceneFileVersion);
+    fprintf(f, "camera %.9g %.9g %.9g\n", viewDist, camRotSidewaysDeg, camRotUpAndOverDeg);
+    fprintf(f, "# mesh tex light  loc.x loc.y loc.z  scale  angle.x angle.y angle.z"
+               "  ambient diffuse specular shine  r g b  brightness texScale\n");
+    for (int i=0; i < nObjects; i++) {
+        SceneRecord r;
+        sceneObjectToRecord(i, &r);
+        fprintf(f, "%d %d %d  %.9g %.9g %.9g  %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g\n",
+                r.meshId, r.texId, r.lightType, r.loc[0], r.loc[1], r.loc[2], r.scale,
+                r.angles[0], r.angles[1], r.angles[2], r.ambient, r.diffuse, r.specular, r.shine,
+                r.rgb[0], r.rgb[1], r.rgb[2], r.brightness, r.texScale);
+    }
+    return !ferror(f);
+}
+
+// Saves the scene, in the text form if fileName ends with .txt.  As for the
+// caches, a temporary file is written and renamed over fileName.
+static bool saveScene(const char* fileName)
+{
+    char tmpPath[300];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", fileName, (int)getpid());
+
+    FILE* f = fopen(tmpPath, isTextSceneFile(fileName) ? "w" : "wb");
+    if (f == NULL) {
+        printf("Error - could not write %s\n", tmpPath);
+        return false;
+    }
+    bool ok = isTextSceneFile(fileName) ? saveSceneText(f) : saveSceneBinary(f);
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok) ok = rename(tmpPath, fileName) == 0;
+    if (!ok) remove(tmpPath);
+    printf(ok ? "Saved %d objects to %s\n" : "Error - could not save %d objects to %s\n",
+           nObjects, fileName);
+    return ok;
+}
+
+static void addLoadedObject(const SceneRecord& r, const char* fileName)
+{
+    if (!recordToSceneObject(r)) {
+        printf("Error - %s: object %d has an invalid mesh, texture or light type\n", fileName, nObjects);
+        exit(1);
+    }
+}
+
+static void loadSceneBinary(FILE* f, const char* fileName)
+{
+    SceneFileHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, sceneFileMagic, 4) != 0
+        || h.version != sceneFileVersion || h.recordBytes != sizeof(SceneRecord)) {
+        printf("Error - %s is not a version %u scene file\n", fileName, sceneFileVersion);
+        exit(1);
+    }
+
+    // Check the length up front, so a corrupt count can't make clearScene
+    // reserve a huge amount of memory.
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0
+        || (uint64_t)st.st_size != sizeof(h) + (uint64_t)h.numObjects * sizeof(SceneRecord)) {
+        printf("Error - %s should hold %u objects, but it is the wrong length\n", fileName, h.numObjects);
+        exit(1);
+    }
+
+    viewDist = h.viewDist;
+    camRotSidewaysDeg = h.camRotSidewaysDeg;
+    camRotUpAndOverDeg = h.camRotUpAndOverDeg;
+
+    clearScene(h.numObjects);
+    vector<SceneRecord> chunk(sceneChunkRecords);
+    for (uint32_t first=0; first < h.numObjects; first += sceneChunkRecords) {
+        size_t n = min((uint32_t)sceneChunkRecords, h.numObjects - first);
+        if (fread(&chunk[0], sizeof(SceneRecord), n, f) != n) {
+            printf("Error - %s is truncated\n", fileName);
+            exit(1);
+        }
+        for (size_t i=0; i < n; i++) addLoadedObject(chunk[i], fileName);
+    }
+}
+
+static void loadSceneText(FILE* f, const char* fileName)
+{
+    char line[1024];
+    int lineNum = 0;
+    unsigned int version = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNum++;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
+        if (sscanf(line, "scene %u", &version) == 1) continue;
+        if (sscanf(line, "camera %f %f %f", &viewDist, &camRotSidewaysDeg, &camRotUpAndOverDeg) == 3)
+            continue;
+
+        SceneRecord r;
+        int meshId, texId, lightType;
+        if (version != sceneFileVersion
+            || sscanf(line, "%d %d %d %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f",
+                      &meshId, &texId, &lightType, &r.loc[0], &r.loc[1], &r.loc[2], &r.scale,
+                      &r.angles[0], &r.angles[1], &r.angles[2],
+                      &r.ambient, &r.diffuse, &r.specular, &r.shine,
+                      &r.rgb[0], &r.rgb[1], &r.rgb[2], &r.brightness, &r.texScale) != 19) {
+            printf("Error - %s line %d is not a version %u scene line\n", fileName, lineNum, sceneFileVersion);
+            exit(1);
+        }
+        r.meshId = meshId; r.texId = texId; r.lightType = lightType;
+        addLoadedObject(r, fileName);
+    }
+}
+
+// Replaces the scene with the one in fileName (either form), and starts
+// loading the meshes and textures it uses.
+static void loadScene(const char* fileName)
+{
+    FILE* f = fopen(fileName, "rb");
+    if (f == NULL) fileErr((char*)fileName);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    char magic[4];
+    bool binary = fread(magic, 1, 4, f) == 4 && memcmp(magic, sceneFileMagic, 4) == 0;
+    rewind(f);
+
+    if (binary) loadSceneBinary(f, fileName);
+    else {
+        clearScene(0);
+        loadSceneText(f, fileName);
+    }
+    fclose(f);
+
+    for (int i=0; i < nObjects; i++) {
+        meshReady(scene.meshId[i]);
+        textureReady(scene.texId[i]);
+    }
+    currObject = nObjects - 1;
+    toolObj = -1;
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    printf("Loaded %d objects from %s in %.1f ms\n", nObjects, fileName, elapsed.count());
+}
+
+//------Shader program--------------------------------------------------------
+//
+// vStart.glsl and fStart.glsl are built into a separate program, or variant,
+// for each combination of the switches at the top of fStart.glsl, which are
+// #defined by variantDefines.  Each object is drawn with the variant for the
+// scene's lights and whether its texture does anything (see objectVariant),
+// so the loops and branches it doesn't need are compiled out.  A variant is
+// built when it is first used, and its binary is saved with
+// glGetProgramBinary as program<n>.bin in the models-textures directory, so
+// later runs skip compiling it.  As with the mesh cache, the header holds a
+// checksum - of the sources, the #defines and the GL driver - and a variant
+// is rebuilt when it doesn't match.  -noprogramcache always compiles.
+
+const int maxVariantDirectional = 4; // With more directional lights the count comes from LightBlock
+const int numVariants = 8 * (maxVariantDirectional + 2);
+enum VariantBits { VARIANT_TEXTURED = 1, VARIANT_SPOT_LIGHTS = 2, VARIANT_CLUSTERED_LIGHTS = 4 };
+// Bits 3 and up hold the number of directional lights, or maxVariantDirectional+1 for more
+
+typedef struct {
+    GLuint program;        // 0 until the variant is first used
+    UniformLocations loc;
+    GLuint projection, modelView;
+    int frame;             // Last frame its per-frame uniforms were set in
+} ShaderVariant;
+
+ShaderVariant variants[numVariants];
+int sceneVariant = 0;    // The bits that depend only on the lights, set by updateLights
+int currentVariant = -1; // Whose locations are in uLoc, projectionU and modelViewU
+int variantFrame = 0;    // Counts display calls, for ShaderVariant::frame
+GLuint vertexShader = 0; // vStart.glsl, compiled once and shared by every variant
+
+// The text of vStart.glsl and fStart.glsl that the variants are built from,
+// read by loadShaderSources (and replaced by Shader reloading)
+const char* shaderFiles[2] = { "vStart.glsl", "fStart.glsl" };
+vector<char> shaderSources[2];
+
+typedef struct {
+    GLuint program;
+    bool cached;             // Loaded from the cache, so already linked
+    uint64_t checksum;       // See variantChecksum
+    chrono::steady_clock::time_point start;
+} VariantBuild;
+
+bool useProgramCache = true; // Cleared by -noprogramcache, or if unsupported (see init)
+
+const char programCacheMagic[4] = { 'P', 'R', 'G', 'C' };
+const uint32_t programCacheVersion = 1;
+
+typedef struct {
+    char magic[4];           // programCacheMagic
+    uint32_t version;        // programCacheVersion
+    uint64_t sourceChecksum; // See variantChecksum
+    uint32_t binaryFormat;   // From glGetProgramBinary
+    uint32_t binaryBytes;
+} ProgramCacheHeader;
+
+const int numVariantSwitches = 4;
+const char* variantSwitchNames[numVariantSwitches] = { "TEXTURED", "SPOT_LIGHTS", "CLUSTERED_LIGHTS",
+                                                       "DIRECTIONAL_LIGHTS" };
+
+// Writes the value of each switch for variant v into defines, formatting each
+// with format, which is given the switch's name and value.
+static void variantDefines(int v, char* defines, const char* format)
+{
+    int directional = v >> 3;
+    int values[numVariantSwitches] = { (v & VARIANT_TEXTURED) != 0, (v & VARIANT_SPOT_LIGHTS) != 0,
+                                       (v & VARIANT_CLUSTERED_LIGHTS) != 0,
+                                       directional <= maxVariantDirectional ? directional : -1 };
+    defines[0] = 0;
+    for (int i=0; i < numVariantSwitches; i++)
+        sprintf(defines + strlen(defines), format, variantSwitchNames[i], values[i]);
+}
+
+// The variant an object is drawn with: the scene's lights, plus whether its
+// texture (or the placeholder while it loads) has any effect.
+static int objectVariant(int obj)
+{
+    int texId = scene.texId[obj];
+    bool white = textureIsWhite[textureReady(texId) ? texId : placeholderTexture];
+    return sceneVariant | (white ? 0 : VARIANT_TEXTURED);
+}
+
+// Reads a whole text file, adding a terminating 0.
+static bool readTextFile(const char* path, vector<char>* text)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return false;
+    char buffer[4096];
+    size_t n;
+    text->clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        text->insert(text->end(), buffer, buffer + n);
+    fclose(f);
+    text->push_back(0);
+    return true;
+}
+
+// Reads the shader files into sources, returning false if either can't be read.
+static bool loadShaderSources(vector<char> sources[2])
+{
+    for (int f=0; f < 2; f++)
+        if (!readTextFile(shaderFiles[f], &sources[f])) {
+            printf("Error - could not read %s\n", shaderFiles[f]);
+            return false;
+        }
+    return true;
+}
+
+// Starts compiling a shader from text, with defines inserted after its
+// #version line.  Whether it compiled is only checked when a program using it
+// is linked (see finishVariantBuild), so the driver may compile it in the
+// background.
+static GLuint compileShader(const vector<char>& text, GLenum type, const char* defines)
+{
+    // #line keeps the line numbers in error messages matching the file
+    const char* source = &text[0];
+    const char* afterVersion = strstr(source, "#version");
+    afterVersion = afterVersion == NULL ? source : afterVersion + strcspn(afterVersion, "\n");
+    if (*afterVersion == '\n') afterVersion++;
+    int versionLines = 0;
+    for (const char* c = source; c < afterVersion; c++) versionLines += *c == '\n';
+
+    char lineDirective[32];
+    sprintf(lineDirective, "#line %d\n", versionLines + 1);
+    const GLchar* parts[4] = { source, defines, lineDirective, afterVersion };
+    GLint lengths[4] = { (GLint)(afterVersion - source), -1, -1, -1 };
+
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 4, parts, lengths);
+    glCompileShader(shader);
+    return shader;
+}
+
+// Every variant uses the same attribute locations, so that they can share
+// the VAOs.  They are bound before linking rather than looked up after, and
+// are part of variantChecksum since a cached binary keeps the locations it
+// was linked with.
+const int numVariantAttribs = 8;
+const char* variantAttribNames[numVariantAttribs] = { "vPosition", "vNormal", "vTexCoord", "iModel",
+                                                      "iAmbient", "iDiffuse", "iSpecular", "iShineTexScale" };
+
+static void variantAttribLocations(GLint locations[numVariantAttribs])
+{
+    GLint l[numVariantAttribs] = { (GLint)vPosition, (GLint)vNormal, (GLint)vTexCoord, iModel,
+                                   iAmbient, iDiffuse, iSpecular, iShineTexScale };
+    memcpy(locations, l, sizeof(l));
+}
+
+static void bindAttribLocations(GLuint program)
+{
+    GLint locations[numVariantAttribs];
+    variantAttribLocations(locations);
+    for (int a=0; a < numVariantAttribs; a++)
+        glBindAttribLocation(program, locations[a], variantAttribNames[a]);
+    CheckError();
+}
+
+// A checksum of everything variant v's binary depends on, when built from sources.
+static uint64_t variantChecksum(int v, const vector<char> sources[2])
+{
+    char defines[256];
+    variantDefines(v, defines, "#define %s %d\n");
+
+    uint64_t hash = hashBytes(hashStart, defines, strlen(defines));
+    for (int f=0; f < 2; f++)
+        hash = hashBytes(hash, &sources[f][0], sources[f].size());
+
+    GLint locations[numVariantAttribs];
+    variantAttribLocations(locations);
+    hash = hashBytes(hash, locations, sizeof(locations));
+    for (int a=0; a < numVariantAttribs; a++)
+        hash = hashBytes(hash, variantAttribNames[a], strlen(variantAttribNames[a]));
+    GLenum strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (int i=0; i < 3; i++) {
+        const char* str = (const char*)glGetString(strings[i]);
+        if (str != NULL) hash = hashBytes(hash, str, strlen(str));
+    }
+    return hash;
+}
+
+static void programCachePath(int v, char* path)
+{
+    sprintf(path, "%s/program%d.bin", dataDir, v);
+}
+
+// Tries to load variant v's program from the cache into program.
+static bool loadCachedProgram(int v, uint64_t checksum, GLuint program)
+{
+    char path[512];
+    programCachePath(v, path);
+    size_t bytes;
+    const unsigned char* mapping = (const unsigned char*)mapFile(path, &bytes);
+    if (mapping == NULL) return false;
+
+    const ProgramCacheHeader* header = (const ProgramCacheHeader*)mapping;
+    GLint linked = 0;
+    if (bytes >= sizeof(ProgramCacheHeader)
+        && memcmp(header->magic, programCacheMagic, 4) == 0
+        && header->version == programCacheVersion
+        && header->sourceChecksum == checksum
+        && bytes == sizeof(ProgramCacheHeader) + header->binaryBytes) {
+        glProgramBinary(program, header->binaryFormat, mapping + sizeof(ProgramCacheHeader),
+                        header->binaryBytes);
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        glGetError(); // A rejected binary (e.g. after a driver update) is not an error here
+    }
+    munmap((void*)mapping, bytes);
+    return linked;
+}
+
+// Saves a linked program's binary for variant v.  Failing to is harmless.  As
+// with the mesh cache, it is written to a temporary file and renamed, so an
+// interrupted write never leaves a truncated binary behind.
+static void saveCachedProgram(int v, uint64_t checksum, GLuint program)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+
+    vector<unsigned char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program, length, &length, &format, &binary[0]);
+    CheckError();
+
+    ProgramCacheHeader header;
+    memcpy(header.magic, programCacheMagic, 4);
+    header.version = programCacheVersion;
+    header.sourceChecksum = checksum;
+    header.binaryFormat = format;
+    header.binaryBytes = length;
+
+    char path[512], tmpPath[600];
+    programCachePath(v, path);
+    sprintf(tmpPath, "%s.%d.tmp", path, (int)getpid());
+
+    FILE* f = fopen(tmpPath, "wb");
+    if (f == NULL) return;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+           && fwrite(&binary[0], 1, length, f) == (size_t)length;
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok) ok = rename(tmpPath, path) == 0;
+    if (!ok) remove(tmpPath);
+}
+
+// Starts building variant v's program from sources, with vertex as the
+// compiled vertex shader.  A cached binary is used if there is one, otherwise
+// the program is linked but, as with compileShader, not checked.
+static VariantBuild startVariantBuild(int v, const vector<char> sources[2], GLuint vertex)
+{
+    VariantBuild build;
+    build.start = chrono::steady_clock::now();
+    build.program = glCreateProgram();
+    build.checksum = useProgramCache ? variantChecksum(v, sources) : 0;
+    build.cached = useProgramCache && loadCachedProgram(v, build.checksum, build.program);
+    if (build.cached) return build;
+
+    char defines[256];
+    variantDefines(v, defines, "#define %s %d\n");
+    GLuint fragment = compileShader(sources[1], GL_FRAGMENT_SHADER, defines);
+
+    glAttachShader(build.program, vertex);
+    glAttachShader(build.program, fragment);
+    bindAttribLocations(build.program);
+    if (useProgramCache) glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(build.program);
+    glDeleteShader(fragment); // Only flagged for deletion while it is attached
+    return build;
+}
+
+// Prints a shader's compile errors, if it has any.
+static void printShaderLog(GLuint shader)
+{
+    GLint compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (compiled) return;
+
+    char log[4096];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    GLint type;
+    glGetShaderiv(shader, GL_SHADER_TYPE, &type);
+    printf("%s failed to compile:\n%s\n", shaderFiles[type == GL_FRAGMENT_SHADER], log);
+}
+
+// Waits for a build from startVariantBuild to finish and checks that it
+// linked, printing any errors, then reports how long it took.  A newly
+// linked program is saved in the cache.
+static bool finishVariantBuild(int v, const VariantBuild& build)
+{
+    if (!build.cached) {
+        GLint linked;
+        glGetProgramiv(build.program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            GLuint shaders[2];
+            GLsizei numShaders;
+            glGetAttachedShaders(build.program, 2, &numShaders, shaders);
+            for (int i=0; i < numShaders; i++) printShaderLog(shaders[i]);
+
+            char log[4096];
+            glGetProgramInfoLog(build.program, sizeof(log), NULL, log);
+            printf("Shader variant %d failed to link:\n%s\n", v, log);
+            return false;
+        }
+        if (useProgramCache) saveCachedProgram(v, build.checksum, build.program);
+    }
+
+    chrono::duration<double, milli> time = chrono::steady_clock::now() - build.start;
+    char switches[256];
+    variantDefines(v, switches, " %s=%d");
+    printf("Shader variant %d (%s) %s in %.1f ms\n", v, switches + 1,
+           build.cached ? "loaded from the cache" : "compiled", time.count());
+    return true;
+}
+
+static void addToShaderReload(int v);
+
+// Builds variant v's program from shaderSources and returns it.  Exits if it
+// doesn't compile or link.  If a shader reload is under way, the variant is
+// also rebuilt from the new text, to be swapped in with the others.
+static GLuint buildVariant(int v)
+{
+    if (vertexShader == 0) vertexShader = compileShader(shaderSources[0], GL_VERTEX_SHADER, "");
+    VariantBuild build = startVariantBuild(v, shaderSources, vertexShader);
+    if (!finishVariantBuild(v, build)) exit(EXIT_FAILURE);
+    addToShaderReload(v);
+    return build.program;
+}
+
+// Looks up the uniform locations for a freshly built shader program, which
+// must be current, and sets the uniforms that never change.
+static void initShaderLocations(GLuint program)
+{
+    projectionU = glGetUniformLocation(program, "Projection");
+    modelViewU = glGetUniformLocation(program, "ModelView");
+
+    uLoc.texture = glGetUniformLocation(program, "texSampler");
+    uLoc.instanced = glGetUniformLocation(program, "Instanced");
+    uLoc.objectIndex = glGetUniformLocation(program, "ObjectIndex");
+    CheckError();
+
+    // The lights come from a uniform buffer bound at lightBlockBinding, and
+    // each object's terms from records bound at objectBlockBinding
+    uLoc.lightBlock = glGetUniformBlockIndex(program, "LightBlock");
+    if (uLoc.lightBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, uLoc.lightBlock, lightBlockBinding);
+    uLoc.objectBlock = glGetUniformBlockIndex(program, "ObjectBlock");
+    if (uLoc.objectBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, uLoc.objectBlock, objectBlockBinding);
+    CheckError();
+
+    // Texture 0 is the only texture type in this program, and is for the rgb
+    // colour of the surface but there could be separate types for, e.g.,
+    // specularity and normals.  The sampler never changes, so set it here.
+    glUniform1i( uLoc.texture, 0 );
+    glUniform1i( glGetUniformLocation(program, "lightData"), lightDataUnit );
+    glUniform1i( glGetUniformLocation(program, "clusterLights"), clusterLightUnit );
+    glUniform1i( glGetUniformLocation(program, "lightIndices"), lightIndexUnit );
+    CheckError();
+}
+
+extern bool instancedDraw; // See Instanced drawing
+
+// Makes variant v current, building it first if need be, and points
+// shaderProgram, uLoc, projectionU and modelViewU at it.  The first time in a
+// frame that a variant is used, its per-frame uniforms are set.
+static void useVariant(int v)
+{
+    ShaderVariant& variant = variants[v];
+    if (v != currentVariant) {
+        if (variant.program == 0) {
+            variant.program = buildVariant(v);
+            useProgram(variant.program);
+            initShaderLocations(variant.program);
+            variant.loc = uLoc;
+            variant.projection = projectionU;
+            variant.modelView = modelViewU;
+            variant.frame = -1;
+        }
+        shaderProgram = variant.program;
+        uLoc = variant.loc;
+        projectionU = variant.projection;
+        modelViewU = variant.modelView;
+        currentVariant = v;
+    }
+    useProgram(shaderProgram);
+
+    if (variant.frame == variantFrame) return;
+    variant.frame = variantFrame;
+    glUniform1i( uLoc.instanced, instancedDraw );
+    glUniformMatrix4fv( projectionU, 1, GL_TRUE, projection );
+    if (instancedDraw)
+        glUniformMatrix4fv( modelViewU, 1, GL_TRUE, mat4() ); // iModel holds the whole model-view
+    CheckError();
+}
+
+// Builds the depth pre-pass program.  It draws from the same VAOs as
+// the variants, so its attributes are bound to the same locations, which
+// takes relinking it.
+static void loadDepthProgram()
+{
+    depthProgram = InitShader( "vDepth.glsl", "fDepth.glsl" );
+    glBindAttribLocation( depthProgram, vPosition, "vPosition" );
+    glBindAttribLocation( depthProgram, iModel, "iModel" );
+    glLinkProgram( depthProgram );
+
+    GLint linked;
+    glGetProgramiv( depthProgram, GL_LINK_STATUS, &linked );
+    if (!linked) {
+        printf("Error - could not relink the depth pre-pass program\n");
+        exit(1);
+    }
+
+    depthProjectionU = glGetUniformLocation(depthProgram, "Projection");
+    depthModelViewU = glGetUniformLocation(depthProgram, "ModelView");
+    depthInstancedU = glGetUniformLocation(depthProgram, "Instanced");
+    CheckError();
+}
+
+//------Shader reloading------------------------------------------------------
+//
+// A thread watches the directory holding vStart.glsl and fStart.glsl with
+// inotify, so that lighting can be tuned without restarting (and reloading
+// every mesh and texture).  When either file is saved, the next frame reads
+// them and starts building every variant built so far from the new text (see
+// updateShaderReload).  With KHR_parallel_shader_compile the driver compiles
+// them on its own threads, and frames are drawn with the old programs until
+// all are done; without it, that frame waits for them.  The new programs
+// then replace the old ones and their uniform locations are looked up again
+// (the attribute locations are fixed, see bindAttribLocations).  If any
+// fails to compile, its errors are printed and the old programs are kept.
+// -nowatch turns watching off.  The watcher also polls an eventfd, which
+// stopWatchingShaders signals at exit so the thread can be joined.
+
+bool watchShaders = true;               // Cleared by -nowatch
+atomic<bool> shaderFilesChanged(false); // Set by the watcher thread
+thread shaderWatcher;
+int stopWatchingFd = -1;                // eventfd signalled by stopWatchingShaders
+
+typedef struct {
+    bool active;                        // Builds have been started
+    vector<char> sources[2];            // The new shaderSources
+    GLuint vertexShader;
+    VariantBuild builds[numVariants];   // program is 0 for variants not being rebuilt
+    chrono::steady_clock::time_point start;
+} ShaderReload;
+
+ShaderReload shaderReload;
+
+// The watcher thread.  Editors save either by writing the file in place
+// (IN_CLOSE_WRITE) or by renaming a new file over it (IN_MOVED_TO).
+static void watchShaderFiles()
+{
+    int fd = inotify_init();
+    if (fd < 0 || inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        printf("Could not watch the shader files for changes\n");
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { stopWatchingFd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents != 0) break; // Stopping
+
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (char* p = buffer; p < buffer + n; ) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            for (int f=0; f < 2; f++)
+                if (event->len > 0 && strcmp(event->name, shaderFiles[f]) == 0)
+                    shaderFilesChanged = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    close(fd);
+}
+
+// Called at exit, as for stopLoaderThreads.
+static void stopWatchingShaders()
+{
+    uint64_t one = 1;
+    ssize_t n;
+    while ((n = write(stopWatchingFd, &one, sizeof(one))) < 0 && errno == EINTR) ;
+    // Without the wakeup the watcher would never leave poll, so leave it be
+    if (n != sizeof(one)) {
+        printf("Could not stop watching the shader files\n");
+        shaderWatcher.detach();
+        return;
+    }
+    shaderWatcher.join();
+    close(stopWatchingFd);
+}
+
+static void startWatchingShaders()
+{
+    if (!watchShaders) return;
+    stopWatchingFd = eventfd(0, 0);
+    if (stopWatchingFd < 0) {
+        printf("Could not watch the shader files for changes\n");
+        return;
+    }
+    shaderWatcher = thread(watchShaderFiles);
+    atexit(stopWatchingShaders);
+}
+
+// Whether the driver has finished every build in shaderReload.  Without
+// KHR_parallel_shader_compile, asking would wait, so they count as finished.
+static bool shaderReloadFinished()
+{
+    if (!GLEW_KHR_parallel_shader_compile) return true;
+    for (int v=0; v < numVariants; v++) {
+        const VariantBuild& build = shaderReload.builds[v];
+        if (build.program == 0 || build.cached) continue;
+        GLint done;
+        glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &done);
+        if (!done) return false;
+    }
+    return true;
+}
+
+// Reads the shader files and starts rebuilding the variants from them.
+static void startShaderReload()
+{
+    ShaderReload& r = shaderReload;
+    if (!loadShaderSources(r.sources)) return;
+    if (r.sources[0] == shaderSources[0] && r.sources[1] == shaderSources[1]) return;
+
+    r.start = chrono::steady_clock::now();
+    r.vertexShader = compileShader(r.sources[0], GL_VERTEX_SHADER, "");
+    for (int v=0; v < numVariants; v++) {
+        r.builds[v].program = 0;
+        if (variants[v].program != 0) r.builds[v] = startVariantBuild(v, r.sources, r.vertexShader);
+    }
+    r.active = true;
+}
+
+// Starts rebuilding variant v from the new text, if a reload is under way and
+// v isn't already part of it.  For variants first used during a reload, which
+// buildVariant has just built from the old text.
+static void addToShaderReload(int v)
+{
+    ShaderReload& r = shaderReload;
+    if (r.active && r.builds[v].program == 0)
+        r.builds[v] = startVariantBuild(v, r.sources, r.vertexShader);
+}
+
+// Checks the builds, then swaps the new programs in if they all succeeded,
+// or deletes them if not.
+static void finishShaderReload()
+{
+    ShaderReload& r = shaderReload;
+    r.active = false;
+
+    bool ok = true;
+    int rebuilt = 0;
+    for (int v=0; v < numVariants; v++)
+        if (r.builds[v].program != 0) {
+            ok = finishVariantBuild(v, r.builds[v]) && ok;
+            rebuilt++;
+        }
+
+    if (!ok) {
+        for (int v=0; v < numVariants; v++)
+            if (r.builds[v].program != 0) glDeleteProgram(r.builds[v].program);
+        glDeleteShader(r.vertexShader);
+        printf("Shader reload failed, keeping the old shaders\n");
+        return;
+    }
+
+    for (int v=0; v < numVariants; v++) {
+        if (r.builds[v].program == 0) continue;
+        ShaderVariant& variant = variants[v];
+        glDeleteProgram(variant.program);
+        variant.program = r.builds[v].program;
+        useProgram(variant.program);
+        initShaderLocations(variant.program);
+        variant.loc = uLoc;
+        variant.projection = projectionU;
+        variant.modelView = modelViewU;
+        variant.frame = -1;
+    }
+    currentVariant = -1; // So that useVariant copies the new locations
+    glDeleteShader(vertexShader);
+    vertexShader = r.vertexShader;
+    for (int f=0; f < 2; f++) shaderSources[f].swap(r.sources[f]);
+    CheckError();
+
+    chrono::duration<double, milli> time = chrono::steady_clock::now() - r.start;
+    printf("Reloaded the shaders: %d variants in %.1f ms\n", rebuilt, time.count());
+}
+
+// Called at the start of each frame: starts a reload if the shader files
+// have changed, and finishes one once the driver has built the programs.
+static void updateShaderReload()
+{
+    if (!shaderReload.active && shaderFilesChanged.exchange(false))
+        startShaderReload();
+    if (shaderReload.active && shaderReloadFinished())
+        finishShaderReload();
+}
+
+// Whether updateShaderReload has anything to do, so redrawTick should draw.
+static bool shaderReloadPending()
+{
+    return shaderReload.active || shaderFilesChanged;
+}
+
+//------The init function-----------------------------------------------------
+
+int stressLights = 0; // Set by -stresslights
+
+// Modified for Part[i] and Part[j]
+static void initDefaultScene();
+static void initLightStressScene(int n);
+static void initLightBuffers();
+static void initStreaming();
+
+void init( void )
+{
+    srand ( fixedSeed ? randomSeed : time(NULL) ); /* initialize random seed - so the starting scene varies */
+    aiInit();
+
+    // for (int i=0; i < numMeshes; i++)
+    //     meshes[i] = NULL;
+
+    glGenVertexArrays(numMeshes+1, vaoIDs); CheckError(); // Allocate vertex array objects for meshes
+    glGenTextures(numTextures+1, textureIDs); CheckError(); // Allocate texture objects
+    glActiveTexture(GL_TEXTURE0); CheckError(); // For surface textures (see bindTexture)
+
+    // Packed normals need OpenGL 3.3 or ARB_vertex_type_2_10_10_10_rev
+    if (compactVertices && !GLEW_VERSION_3_3 && !GLEW_ARB_vertex_type_2_10_10_10_rev) {
+        printf("-compact needs GL_INT_2_10_10_10_REV vertices, using the planar layout\n");
+        compactVertices = false;
+    }
+    if (compressTextures && !GLEW_EXT_texture_compression_s3tc) {
+        printf("-compresstextures needs EXT_texture_compression_s3tc, using RGB8 textures\n");
+        compressTextures = false;
+    }
+
+    initLightBuffers(); // See Clustered lighting
+    initProfiling();
+    initStreaming(); // See Per-object data
+
+    // The shader variants are built as they are first drawn with (see useVariant)
+    if (useProgramCache && !GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) {
+        printf("The shader program cache needs ARB_get_program_binary, always compiling\n");
+        useProgramCache = false;
+    }
+    if (!loadShaderSources(shaderSources)) exit(1);
+    startWatchingShaders(); // See Shader reloading
+    loadDepthProgram();
+
+    createPlaceholders();
+
+    if (sceneFileName != NULL)
+        loadScene(sceneFileName);
+    else if (stressLights > 0)
+        initLightStressScene(stressLights);
+    else
+        initDefaultScene();
+
+    // We need to enable the depth test to discard fragments that
+    // are behind previously drawn fragments for the same pixel.
+    glEnable( GL_DEPTH_TEST );
+    doRotate(); // Start in camera rotate mode.
+    glClearColor( 0.0, 0.0, 0.0, 1.0 ); /* black background */
+}
+
+// The starting scene when there's no -scene file.
+static void initDefaultScene()
+{
+    // Objects 0, and 1 are the ground and the first light.
+    addObject(0); // Square for the ground
+    scene.loc[0] = vec4(0.0, 0.0, 0.0, 1.0);
+    scene.scale[0] = 10.0;
+    scene.angles[0][0] = 90.0; // Rotate it.
+    scene.material[0].texScale = 5.0; // Repeat the texture.
+
+    addObject(55); // Sphere for the first light
+    scene.loc[1] = vec4(2.0, 1.0, 1.0, 1.0);
+    scene.scale[1] = 0.1;
+    scene.texId[1] = 0; // Plain texture
+    scene.material[1].brightness = 0.4; // The light's brightness is 5 times this (below).
+    scene.lightType[1] = LIGHT_POINT;
+
+    addObject(55); // Sphere for the second light - KV
+    scene.loc[2] = vec4(2.0, 2.0, 1.0, 1.0); // Added height to show in scene
+    scene.scale[2] = 0.1;
+    scene.texId[2] = 0; // Plain texture
+    scene.material[2].brightness = 0.2; 
+    scene.lightType[2] = LIGHT_DIRECTIONAL; // Moves with the camera's rotation only
+
+    addObject(55); // Third rotational light - KV
+    scene.loc[3] = vec4(2.0, 3.0, 1.0, 1.0); // Added height to see in scene
+    scene.scale[3] = 0.1;
+    scene.texId[3] = 0; // Plain texture
+    scene.material[3].brightness = 0.2; 
+    scene.lightType[3] = LIGHT_SPOT; // Aimed with angles[1] (pitch) and angles[2] (yaw)
+
+    addObject(rand() % numMeshes); // A test mesh
+}
+
+// The starting scene with -stresslights n: a ground square lit by n coloured
+// point lights, with n/4 meshes among them, for measuring Clustered lighting.
+// Both are spread over a square that grows with n, about 64 square units per
+// light, so each light reaches only part of the scene.
+static void initLightStressScene(int n)
+{
+    float halfWidth = 4 * sqrt((float)n);
+    viewDist = min(halfWidth / 3, 30.0f); // Far enough back to see many of the lights
+
+    addObject(0); // Square for the ground
+    scene.loc[0] = vec4(0.0, 0.0, 0.0, 1.0);
+    scene.scale[0] = halfWidth;
+    scene.angles[0][0] = 90.0;
+    scene.material[0].texScale = halfWidth / 2;
+
+    // Every light adds ambient light everywhere, so the materials' ambient
+    // terms are scaled down to stop it washing the scene out
+    scene.material[0].ambient = 4.0 / n;
+
+    for (int i=0; i < n + n/4; i++) {
+        int obj = nObjects;
+        addObject(i < n ? 55 : rand() % numMeshes);
+        scene.material[obj].ambient = 4.0 / n;
+        scene.loc[obj] = vec4((rand() / (float)RAND_MAX * 2 - 1) * halfWidth, 0.0,
+                              (rand() / (float)RAND_MAX * 2 - 1) * halfWidth, 1.0);
+        if (i >= n) {
+            scene.scale[obj] = 0.01 + rand() % 100 / 5000.0;
+            scene.angles[obj][1] = rand() % 360;
+            continue;
+        }
+
+        // Dim lights just above the ground, which reach 17 to 30 units
+        Material& m = scene.material[obj];
+        scene.loc[obj][1] = 0.5 + rand() % 100 / 100.0;
+        scene.scale[obj] = 0.1;
+        scene.texId[obj] = 0; // Plain texture
+        m.rgb = vec3(rand() % 101 / 100.0, rand() % 101 / 100.0, rand() % 101 / 100.0);
+        m.brightness = 0.1 + rand() % 101 / 500.0;
+        scene.lightType[obj] = LIGHT_POINT;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+// Set the model matrix - this should combine translation, rotation and scaling based on what's
+// in the scene arrays (see near the top of the program).
+// Modified for Part[b]
+static mat4 modelMatrix(int obj)
+{
+    //Form angles matrix to manipulate mesh
+    // Part[b]
+
+    const vec3& angles = scene.angles[obj];
+    mat4 xRotation = RotateX(angles[0]);
+    mat4 yRotation = RotateY(angles[1]);
+    mat4 zRotation = RotateZ(angles[2]);
+    mat4 rotationMatrix = xRotation * yRotation * zRotation; // Matrix for manipulating the rotation matrix.
+
+    // Final matrix required for transformation.
+    return Translate(scene.loc[obj]) * rotationMatrix * Scale(scene.scale[obj]);
+}
+
+//------Batched transforms----------------------------------------------------
+//
+// computeModelViews works out every object's model-view matrix for a frame in
+// one pass over the scene.  Model matrices are cached in scene.model and only
+// recomputed for objects marked with markMoved (or new ones), so when the
+// camera moves just the view multiply is redone, and when nothing moves the
+// previous frame's matrices are reused as they are.
+//
+// Instead of the four mat4 multiplies in view * modelMatrix(obj), the rotation
+// Rx*Ry*Rz is written out in closed form and scaled, and each model column is
+// multiplied by the view matrix as a weighted sum of the view's columns, four
+// floats at a time with SSE where it's available.  The results go to
+// modelViews as column-major floats, 16 per object, which glUniformMatrix4fv
+// takes without transposing and which match InstanceData's transposed model
+// matrix.
+
+vector<float> modelViews; // Filled by computeModelViews
+int modelsComputed = 0;   // Model matrices recomputed, reset each second by timer()
+
+static void bvhRefit(int obj);
+
+// Recomputes scene.model[obj] from loc, scale and angles.
+static void computeModel(int obj)
+{
+    const vec3& angles = scene.angles[obj];
+    float sx = sinf(angles[0] * DegreesToRadians), cx = cosf(angles[0] * DegreesToRadians);
+    float sy = sinf(angles[1] * DegreesToRadians), cy = cosf(angles[1] * DegreesToRadians);
+    float sz = sinf(angles[2] * DegreesToRadians), cz = cosf(angles[2] * DegreesToRadians);
+    float s = scene.scale[obj];
+    const vec4& loc = scene.loc[obj];
+
+    // The columns of Translate * RotateX * RotateY * RotateZ * Scale
+    ModelMatrix& m = scene.model[obj];
+    float cols[4][4] = {
+        {  s*cy*cz, s*(cx*sz + sx*sy*cz), s*(sx*sz - cx*sy*cz), 0.0 },
+        { -s*cy*sz, s*(cx*cz - sx*sy*sz), s*(sx*cz + cx*sy*sz), 0.0 },
+        {  s*sy,    -s*sx*cy,             s*cx*cy,              0.0 },
+        {  loc[0],  loc[1],               loc[2],               1.0 } };
+    memcpy(m.col, cols, sizeof(cols));
+
+    scene.modelDirty[obj] = 0;
+    modelsComputed++;
+    if (!bvhStale) bvhRefit(obj);
+}
+
+static void computeModelViews(const mat4& viewMatrix)
+{
+    // The view matrix's columns (Angel's mat4 is row-major)
+    float v[4][4];
+    for (int c=0; c < 4; c++)
+        for (int r=0; r < 4; r++) v[c][r] = viewMatrix[r][c];
+
+    // Every model-view needs redoing if the camera has moved.  Objects that
+    // were added, or shifted down by a delete, are already marked dirty.
+    static float lastView[4][4];
+    bool viewChanged = memcmp(v, lastView, sizeof(v)) != 0;
+    memcpy(lastView, v, sizeof(v));
+    modelViews.resize(16 * nObjects);
+
+#ifdef __SSE__
+    __m128 v0 = _mm_loadu_ps(v[0]), v1 = _mm_loadu_ps(v[1]);
+    __m128 v2 = _mm_loadu_ps(v[2]), v3 = _mm_loadu_ps(v[3]);
+#endif
+
+    for (int i=0; i < nObjects; i++) {
+        bool moved = scene.modelDirty[i];
+        if (moved) computeModel(i);
+        if (!moved && !viewChanged) continue;
+
+        const float (*m)[4] = scene.model[i].col;
+        float* out = &modelViews[16*i];
+
+#ifdef __SSE__
+        for (int c=0; c < 3; c++) {
+            __m128 col = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v0, _mm_set1_ps(m[c][0])),
+                                               _mm_mul_ps(v1, _mm_set1_ps(m[c][1]))),
+                                    _mm_mul_ps(v2, _mm_set1_ps(m[c][2])));
+            _mm_storeu_ps(out + 4*c, col);
+        }
+        __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v0, _mm_set1_ps(m[3][0])),
+                                         _mm_mul_ps(v1, _mm_set1_ps(m[3][1]))),
+                              _mm_add_ps(_mm_mul_ps(v2, _mm_set1_ps(m[3][2])), v3));
+        _mm_storeu_ps(out + 12, t);
+#else
+        for (int r=0; r < 4; r++) {
+            for (int c=0; c < 3; c++)
+                out[4*c + r] = v[0][r]*m[c][0] + v[1][r]*m[c][1] + v[2][r]*m[c][2];
+            out[12 + r] = v[0][r]*m[3][0] + v[1][r]*m[3][1] + v[2][r]*m[3][2] + v[3][r];
+        }
+#endif
+    }
+}
+
+// Replaces the scene with n objects at random positions, sizes and angles,
+// for the benchmarks.  They are spread over a square that grows with n, about
+// four square units per object.
+static void randomScene(int n)
+{
+    srand(randomSeed);
+    clearScene(n);
+    float halfWidth = sqrt((float)n);
+    for (int i=0; i < n; i++) {
+        int obj = newSceneObject();
+        scene.loc[obj] = vec4((rand() / (float)RAND_MAX * 2 - 1) * halfWidth, rand() % 201 / 100.0,
+                              (rand() / (float)RAND_MAX * 2 - 1) * halfWidth, 1.0);
+        scene.scale[obj] = 0.005 + rand() % 1000 / 1000.0;
+        scene.angles[obj] = vec3(rand() % 360, rand() % 360, rand() % 360);
+        scene.meshId[obj] = rand() % numMeshes;
+    }
+}
+
+// Returns the largest difference between modelViews and viewMatrix * modelMatrix(obj).
+static float modelViewError(const mat4& viewMatrix)
+{
+    float maxDiff = 0;
+    for (int i=0; i < nObjects; i++) {
+        mat4 mv = viewMatrix * modelMatrix(i);
+        for (int r=0; r < 4; r++)
+            for (int c=0; c < 4; c++)
+                maxDiff = max(maxDiff, fabsf(mv[r][c] - modelViews[16*i + 4*c + r]));
+    }
+    return maxDiff;
+}
+
+// -benchtransforms N: times computeModelViews against view * modelMatrix(obj)
+// for each of N random objects, and checks that they agree.  The batched path
+// is timed with every object moving, with only the camera moving, and with
+// nothing moving.
+static void benchTransforms(int n)
+{
+    randomScene(n);
+    mat4 views[2] = { Translate(0.0, 0.0, -viewDist) * RotateX(camRotUpAndOverDeg) * RotateY(35.0),
+                      Translate(0.0, 0.0, -viewDist) * RotateX(camRotUpAndOverDeg) * RotateY(36.0) };
+
+    const int reps = 20;
+    vector<mat4> perObject(n);
+    double times[4]; // Per-object, all moving, camera moving, nothing moving
+    float maxDiff = 0;
+
+    for (int test=0; test < 4; test++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int rep=0; rep < reps; rep++) {
+            const mat4& viewMatrix = views[test == 2 ? rep % 2 : 0];
+            if (test == 0) {
+                for (int i=0; i < n; i++) perObject[i] = viewMatrix * modelMatrix(i);
+                continue;
+            }
+            if (test == 1)
+                for (int i=0; i < n; i++) markMoved(i);
+            computeModelViews(viewMatrix);
+        }
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        times[test] = elapsed.count() / reps;
+        if (test > 0) maxDiff = max(maxDiff, modelViewError(views[test == 2 ? (reps-1) % 2 : 0]));
+    }
+
+    printf("%d objects, %d frames each, ms/frame: per-object %.3f, batched %.3f (%.1fx),"
+           " camera moving %.3f, nothing moving %.3f; max difference %g\n",
+           n, reps, times[0], times[1], times[0] / times[1], times[2], times[3], maxDiff);
+}
+
+//------Frustum culling-------------------------------------------------------
+//
+// Before anything is drawn, each object's bounds are tested against the six
+// planes of the view frustum, taken from the rows of projection * view.  The
+// mesh's bounding sphere, moved by the object's cached model matrix, settles
+// objects that are well inside or outside.  Objects that straddle a plane are
+// then tested with the mesh's bounding box, oriented by the model matrix.
+// Objects whose mesh is still loading use the placeholder's bounds.  The
+// renderQueue entries that survive, still in sort order, go to visibleQueue.
+
+bool frustumCulling = true;        // Toggled with the 'f' key, cleared by -noculling
+vector<RenderItem> visibleQueue;   // Filled by cullRenderQueue
+int lastDrawn = 0, lastCulled = 0; // Object counts for the last frame, shown by timer()
+
+// Each plane is (a, b, c, d) with (a, b, c) a unit normal pointing into the
+// frustum, so a*x + b*y + c*z + d is the distance of (x, y, z) inside it.
+static void frustumPlanes(const mat4& viewProjection, float planes[6][4])
+{
+    for (int i=0; i < 3; i++) {
+        for (int c=0; c < 4; c++) {
+            planes[2*i][c]   = viewProjection[3][c] + viewProjection[i][c];
+            planes[2*i+1][c] = viewProjection[3][c] - viewProjection[i][c];
+        }
+    }
+    for (int p=0; p < 6; p++) {
+        float len = sqrtf(planes[p][0]*planes[p][0] + planes[p][1]*planes[p][1] + planes[p][2]*planes[p][2]);
+        for (int c=0; c < 4; c++) planes[p][c] /= len;
+    }
+}
+
+// False if the object is certainly outside the frustum.
+static bool objectVisible(int obj, const float planes[6][4])
+{
+    int meshId = scene.meshId[obj];
+    const MeshBounds& b = meshBounds[meshLoadStates[meshId] == LOADED ? meshId : placeholderMesh];
+    const float (*m)[4] = scene.model[obj].col;
+
+    float centre[3];
+    for (int r=0; r < 3; r++)
+        centre[r] = m[0][r]*b.center[0] + m[1][r]*b.center[1] + m[2][r]*b.center[2] + m[3][r];
+    float radius = fabsf(scene.scale[obj]) * b.radius; // Scaling is uniform
+
+    float dist[6];
+    bool straddles = false;
+    for (int p=0; p < 6; p++) {
+        dist[p] = planes[p][0]*centre[0] + planes[p][1]*centre[1] + planes[p][2]*centre[2] + planes[p][3];
+        if (dist[p] < -radius) return false;
+        if (dist[p] < radius) straddles = true;
+    }
+    if (!straddles) return true;
+
+    // The box's extent along each plane normal, from its scaled and rotated axes
+    for (int p=0; p < 6; p++) {
+        float extent = 0;
+        for (int axis=0; axis < 3; axis++)
+            extent += fabsf(planes[p][0]*m[axis][0] + planes[p][1]*m[axis][1] + planes[p][2]*m[axis][2])
+                      * b.halfSize[axis];
+        if (dist[p] < -extent) return false;
+    }
+    return true;
+}
+
+//------Bounding volume hierarchy---------------------------------------------
+//
+// bvhNodes is a binary tree of axis-aligned boxes around the objects' world
+// bounds, used for frustum culling (cullObjects) and for picking objects
+// with the mouse (pickObject).  It is built top-down, splitting each node
+// where the surface area heuristic (SAH) says is cheapest, and rebuilt
+// whenever bvhStale is set: when objects are added or deleted, or a mesh is
+// uploaded and so changes size.  When an object moves, computeModel refits
+// its leaf and the leaf's ancestors instead.  Refitting loosens the tree, so
+// it is also rebuilt once its SAH cost (the summed area of its nodes) has
+// grown by bvhRebuildGrowth since it was built.
+
+const int bvhLeafObjects = 4;          // Most objects in a leaf
+const int bvhBins = 16;                // Split positions tried per axis
+const int bvhSAHDepth = 48;            // Below this depth nodes are just halved, which bounds the depth
+const int bvhMaxDepth = bvhSAHDepth + 32;
+const double bvhRebuildGrowth = 1.5;
+
+typedef struct {
+    float lo[3], hi[3];
+} Box;
+
+typedef struct {
+    Box box;
+    int parent;        // -1 for the root
+    int left, right;   // Child nodes, or -1 for a leaf
+    int first, count;  // A leaf's objects are bvhObjects[first] onwards
+} BVHNode;
+
+vector<BVHNode> bvhNodes;   // bvhNodes[0] is the root
+vector<int> bvhObjects;     // Object numbers, grouped by leaf
+vector<int> bvhLeaf;        // The leaf holding each object
+vector<Box> objectBoxes;    // The world bounds of each object
+double bvhCost = 0, bvhBuildCost = 0; // SAH cost now, and when last built
+
+static void emptyBox(Box* b)
+{
+    for (int i=0; i < 3; i++) { b->lo[i] = 1e30; b->hi[i] = -1e30; }
+}
+
+static void growBox(Box* b, const Box& other)
+{
+    for (int i=0; i < 3; i++) {
+        b->lo[i] = min(b->lo[i], other.lo[i]);
+        b->hi[i] = max(b->hi[i], other.hi[i]);
+    }
+}
+
+static double boxArea(const Box& b)
+{
+    double x = b.hi[0]-b.lo[0], y = b.hi[1]-b.lo[1], z = b.hi[2]-b.lo[2];
+    return (x < 0 || y < 0 || z < 0) ? 0 : 2*(x*y + y*z + z*x);
+}
+
+// The world-space box around an object's mesh bounding box, from its cached
+// model matrix.
+static Box objectWorldBox(int obj)
+{
+    int meshId = scene.meshId[obj];
+    const MeshBounds& b = meshBounds[meshLoadStates[meshId] == LOADED ? meshId : placeholderMesh];
+    const float (*m)[4] = scene.model[obj].col;
+
+    Box box;
+    for (int r=0; r < 3; r++) {
+        float centre = m[0][r]*b.center[0] + m[1][r]*b.center[1] + m[2][r]*b.center[2] + m[3][r];
+        float extent = fabsf(m[0][r])*b.halfSize[0] + fabsf(m[1][r])*b.halfSize[1]
+                     + fabsf(m[2][r])*b.halfSize[2];
+        box.lo[r] = centre - extent;
+        box.hi[r] = centre + extent;
+    }
+    return box;
+}
+
+// The bin along axis that obj's centre falls in, for centres spanning extent from lo.
+static int bvhBin(int obj, int axis, float lo, float extent)
+{
+    const Box& ob = objectBoxes[obj];
+    return min(bvhBins-1, (int)(((ob.lo[axis]+ob.hi[axis])/2 - lo) / extent * bvhBins));
+}
+
+// Builds the subtree for bvhObjects[first..first+count-1], returning its node.
+static int bvhBuildNode(int first, int count, int parent, int depth)
+{
+    int node = bvhNodes.size();
+    bvhNodes.push_back(BVHNode());
+
+    Box box, centres;
+    emptyBox(&box);
+    emptyBox(&centres);
+    for (int i=first; i < first+count; i++) {
+        const Box& ob = objectBoxes[bvhObjects[i]];
+        growBox(&box, ob);
+        Box centre;
+        for (int a=0; a < 3; a++) centre.lo[a] = centre.hi[a] = (ob.lo[a]+ob.hi[a])/2;
+        growBox(&centres, centre);
+    }
+    bvhNodes[node].box = box;
+    bvhNodes[node].parent = parent;
+    bvhNodes[node].left = bvhNodes[node].right = -1;
+    bvhNodes[node].first = first;
+    bvhNodes[node].count = count;
+    bvhCost += boxArea(box);
+
+    if (count <= bvhLeafObjects) {
+        for (int i=first; i < first+count; i++) bvhLeaf[bvhObjects[i]] = node;
+        return node;
+    }
+
+    // Bin the objects by their centres along each axis, and find the split
+    // between bins with the least SAH cost: sum over each side of its box
+    // area times its number of objects.
+    int bestAxis = -1, bestSplit = 0;
+    double bestCost = 1e300;
+    for (int axis=0; axis < 3 && depth < bvhSAHDepth; axis++) {
+        float lo = centres.lo[axis], extent = centres.hi[axis] - lo;
+        if (extent <= 0) continue;
+
+        Box binBoxes[bvhBins];
+        int binCounts[bvhBins] = { 0 };
+        for (int b=0; b < bvhBins; b++) emptyBox(&binBoxes[b]);
+        for (int i=first; i < first+count; i++) {
+            int b = bvhBin(bvhObjects[i], axis, lo, extent);
+            growBox(&binBoxes[b], objectBoxes[bvhObjects[i]]);
+            binCounts[b]++;
+        }
+
+        // rightCost[s] is the cost of bins s onwards
+        double rightCost[bvhBins];
+        Box right;
+        emptyBox(&right);
+        int rightCount = 0;
+        for (int b=bvhBins-1; b > 0; b--) {
+            growBox(&right, binBoxes[b]);
+            rightCount += binCounts[b];
+            rightCost[b] = boxArea(right) * rightCount;
+        }
+        Box left;
+        emptyBox(&left);
+        int leftCount = 0;
+        for (int s=1; s < bvhBins; s++) {
+            growBox(&left, binBoxes[s-1]);
+            leftCount += binCounts[s-1];
+            double cost = boxArea(left) * leftCount + rightCost[s];
+            if (leftCount > 0 && leftCount < count && cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = s;
+            }
+        }
+    }
+
+    // Objects in bins before bestSplit go left.  With no split (when every
+    // centre is the same, or the tree is deep) the objects are just halved.
+    int mid = first + count/2;
+    if (bestAxis >= 0) {
+        float lo = centres.lo[bestAxis], extent = centres.hi[bestAxis] - lo;
+        int i = first, j = first + count - 1;
+        while (i <= j) {
+            if (bvhBin(bvhObjects[i], bestAxis, lo, extent) < bestSplit) i++;
+            else swap(bvhObjects[i], bvhObjects[j--]);
+        }
+        mid = i;
+    }
+
+    int left = bvhBuildNode(first, mid - first, node, depth+1);
+    int right = bvhBuildNode(mid, first + count - mid, node, depth+1);
+    bvhNodes[node].left = left;
+    bvhNodes[node].right = right;
+    return node;
+}
+
+// Rebuilds the tree from scratch.  Expects every model matrix to be up to date.
+static void bvhBuild()
+{
+    objectBoxes.resize(nObjects);
+    bvhObjects.resize(nObjects);
+    bvhLeaf.resize(nObjects);
+    for (int i=0; i < nObjects; i++) {
+        objectBoxes[i] = objectWorldBox(i);
+        bvhObjects[i] = i;
+    }
+
+    bvhNodes.clear();
+    bvhNodes.reserve(2*nObjects);
+    bvhCost = 0;
+    if (nObjects > 0) bvhBuildNode(0, nObjects, -1, 0);
+    bvhBuildCost = bvhCost;
+    bvhStale = false;
+}
+
+// Recomputes a moved object's box and refits the nodes above it.
+static void bvhRefit(int obj)
+{
+    objectBoxes[obj] = objectWorldBox(obj);
+
+    for (int node = bvhLeaf[obj]; node >= 0; node = bvhNodes[node].parent) {
+        BVHNode& n = bvhNodes[node];
+        bvhCost -= boxArea(n.box);
+        if (n.left < 0) {
+            emptyBox(&n.box);
+            for (int i=n.first; i < n.first+n.count; i++) growBox(&n.box, objectBoxes[bvhObjects[i]]);
+        }
+        else {
+            n.box = bvhNodes[n.left].box;
+            growBox(&n.box, bvhNodes[n.right].box);
+        }
+        bvhCost += boxArea(n.box);
+    }
+}
+
+// Brings the tree up to date after computeModelViews, rebuilding it if needed.
+static void updateBVH()
+{
+    if (bvhStale || bvhCost > bvhRebuildGrowth * bvhBuildCost)
+        bvhBuild();
+}
+
+//------Culling and picking with the BVH--------------------------------------
+
+vector<unsigned char> objectInFrustum; // Set by cullNode
+
+// Marks the objects under node that may be in the frustum.  inside is true
+// when node is already known to be entirely inside, so nothing below it
+// needs testing.
+static void cullNode(int node, const float planes[6][4], bool inside)
+{
+    const BVHNode& n = bvhNodes[node];
+    if (!inside) {
+        inside = true;
+        for (int p=0; p < 6; p++) {
+            float dist = planes[p][3], extent = 0;
+            for (int a=0; a < 3; a++) {
+                dist += planes[p][a] * (n.box.lo[a]+n.box.hi[a])/2;
+                extent += fabsf(planes[p][a]) * (n.box.hi[a]-n.box.lo[a])/2;
+            }
+            if (dist < -extent) return;
+            if (dist < extent) inside = false;
+        }
+    }
+
+    if (n.left >= 0) {
+        cullNode(n.left, planes, inside);
+        cullNode(n.right, planes, inside);
+        return;
+    }
+    for (int i=n.first; i < n.first+n.count; i++) {
+        int obj = bvhObjects[i];
+        if (inside || objectVisible(obj, planes)) objectInFrustum[obj] = 1;
+    }
+}
+
+// Sets objectInFrustum for every object.  Expects computeModelViews and
+// updateBVH to have been called for this frame.
+static void cullObjects(const mat4& viewProjection)
+{
+    float planes[6][4];
+    frustumPlanes(viewProjection, planes);
+
+    objectInFrustum.assign(nObjects, frustumCulling ? 0 : 1);
+    if (frustumCulling && nObjects > 0) cullNode(0, planes, false);
+}
+
+// Fills visibleQueue from renderQueue, keeping the objects cullObjects found
+// to be in the frustum.
+static void cullRenderQueue()
+{
+    visibleQueue.clear();
+    for (int q=0; q < nObjects; q++)
+        if (objectInFrustum[renderQueue[q].obj])
+            visibleQueue.push_back(renderQueue[q]);
+
+    lastDrawn = visibleQueue.size();
+    lastCulled = nObjects - lastDrawn;
+}
+
+// Finds the distances along the line through origin where it enters and
+// leaves box, returning false if it misses.  These are negative for points
+// behind origin.  invDir holds 1/direction for each axis.
+static bool rayBox(const float origin[3], const float invDir[3], const Box& box, float* tNear, float* tFar)
+{
+    *tNear = -1e30;
+    *tFar = 1e30;
+    for (int a=0; a < 3; a++) {
+        float t0 = (box.lo[a] - origin[a]) * invDir[a], t1 = (box.hi[a] - origin[a]) * invDir[a];
+        *tNear = max(*tNear, min(t0, t1));
+        *tFar = min(*tFar, max(t0, t1));
+    }
+    return *tNear <= *tFar;
+}
+
+// Returns the distance along the ray to where it enters the object's mesh
+// bounding box, or -1 if it misses.  Objects with the camera inside their box
+// are missed too, so they don't hide everything else.  The box is tested in
+// the object's own coordinates: the model matrix's rotation and scale columns
+// are orthogonal with length scale, so their inverse is their transpose over
+// scale squared.
+static float rayObjectDistance(int obj, const float origin[3], const float dir[3])
+{
+    float s = scene.scale[obj];
+    if (s == 0) return -1;
+    const float (*m)[4] = scene.model[obj].col;
+
+    float localOrigin[3], invDir[3];
+    for (int a=0; a < 3; a++) {
+        localOrigin[a] = 0;
+        float localDir = 0;
+        for (int r=0; r < 3; r++) {
+            localOrigin[a] += m[a][r] * (origin[r] - m[3][r]) / (s*s);
+            localDir += m[a][r] * dir[r] / (s*s);
+        }
+        invDir[a] = 1 / localDir;
+    }
+
+    int meshId = scene.meshId[obj];
+    const MeshBounds& b = meshBounds[meshLoadStates[meshId] == LOADED ? meshId : placeholderMesh];
+    Box box;
+    for (int a=0; a < 3; a++) {
+        box.lo[a] = b.center[a] - b.halfSize[a];
+        box.hi[a] = b.center[a] + b.halfSize[a];
+    }
+    float tNear, tFar;
+    return rayBox(localOrigin, invDir, box, &tNear, &tFar) && tNear > 0 ? tNear : -1;
+}
+
+// The world-space ray from the camera through window position (x, y).
+static void pickRay(int x, int y, float origin[3], float dir[3])
+{
+    float ndcX = 2.0 * (x + 0.5) / windowWidth - 1, ndcY = 1 - 2.0 * (y + 0.5) / windowHeight;
+    float viewDir[3] = { (ndcX + projection[0][2]) / projection[0][0],
+                         (ndcY + projection[1][2]) / projection[1][1], -1 };
+
+    // view is a rotation and a translation, so its inverse is easy
+    for (int a=0; a < 3; a++) {
+        origin[a] = dir[a] = 0;
+        for (int r=0; r < 3; r++) {
+            origin[a] -= view[r][a] * view[r][3];
+            dir[a] += view[r][a] * viewDir[r];
+        }
+    }
+}
+
+// Returns the nearest object under window position (x, y), or -1.  Objects
+// are hit-tested with their bounding boxes.  The ground is ignored, since it
+// is under everything.
+static int pickObject(int x, int y)
+{
+    computeModelViews(view); // Catch up with anything moved since the last frame
+    updateBVH();
+    if (nObjects == 0) return -1;
+
+    float origin[3], dir[3], invDir[3];
+    pickRay(x, y, origin, dir);
+    for (int a=0; a < 3; a++) invDir[a] = 1 / dir[a];
+
+    int picked = -1;
+    float pickedDist = 1e30;
+    int stack[bvhMaxDepth+2], depth = 0; // Nodes still to visit
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const BVHNode& n = bvhNodes[stack[--depth]];
+        float tNear, tFar;
+        if (!rayBox(origin, invDir, n.box, &tNear, &tFar) || tFar < 0 || tNear >= pickedDist)
+            continue;
+
+        if (n.left >= 0) {
+            stack[depth++] = n.right;
+            stack[depth++] = n.left;
+            continue;
+        }
+        for (int i=n.first; i < n.first+n.count; i++) {
+            int obj = bvhObjects[i];
+            if (obj == 0) continue;
+            float objDist = rayObjectDistance(obj, origin, dir);
+            if (objDist >= 0 && objDist < pickedDist) {
+                picked = obj;
+                pickedDist = objDist;
+            }
+        }
+    }
+    return picked;
+}
+
+// -benchbvh N: builds the BVH over N random objects, then times frustum
+// culling and picking with it against testing every object, and checks that
+// they agree.
+static void benchBVH(int n)
+{
+    randomScene(n);
+    setPlaceholderBounds(); // No meshes are loaded, so every object uses these
+    float aspect = (float)windowWidth / windowHeight;
+    projection = Frustum(-0.01*aspect, 0.01*aspect, -0.01, 0.01, 0.01, 100.0);
+    view = Translate(0.0, 0.0, -viewDist) * RotateX(camRotUpAndOverDeg) * RotateY(35.0);
+    mat4 viewProjection = projection * view;
+    computeModelViews(view);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bvhBuild();
+    chrono::duration<double, milli> buildTime = chrono::steady_clock::now() - start;
+
+    const int reps = 20, picks = 1000;
+    float planes[6][4];
+    frustumPlanes(viewProjection, planes);
+    vector<unsigned char> linearInFrustum(n);
+
+    start = chrono::steady_clock::now();
+    for (int rep=0; rep < reps; rep++)
+        for (int i=0; i < n; i++) linearInFrustum[i] = objectVisible(i, planes);
+    chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+    for (int rep=0; rep < reps; rep++)
+        cullObjects(viewProjection);
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    updateRenderQueue();
+    cullRenderQueue(); // For lastDrawn
+    chrono::duration<double, milli> linearCull = middle - start, bvhCull = end - middle;
+
+    int cullMismatches = 0;
+    for (int i=0; i < n; i++) cullMismatches += linearInFrustum[i] != objectInFrustum[i];
+
+    // Picks at random window positions, first testing every object
+    vector<int> xs(picks), ys(picks), linearPicks(picks);
+    for (int p=0; p < picks; p++) { xs[p] = rand() % windowWidth; ys[p] = rand() % windowHeight; }
+
+    start = chrono::steady_clock::now();
+    for (int p=0; p < picks; p++) {
+        float origin[3], dir[3], best = 1e30;
+        pickRay(xs[p], ys[p], origin, dir);
+        linearPicks[p] = -1;
+        for (int i=1; i < n; i++) {
+            float dist = rayObjectDistance(i, origin, dir);
+            if (dist >= 0 && dist < best) { best = dist; linearPicks[p] = i; }
+        }
+    }
+    middle = chrono::steady_clock::now();
+    int pickMismatches = 0, hits = 0;
+    for (int p=0; p < picks; p++) {
+        int picked = pickObject(xs[p], ys[p]);
+        pickMismatches += picked != linearPicks[p];
+        hits += picked >= 0;
+    }
+    end = chrono::steady_clock::now();
+    chrono::duration<double, milli> linearPick = middle - start, bvhPick = end - middle;
+
+    printf("%d objects, %d BVH nodes built in %.3f ms\n", n, (int)bvhNodes.size(), buildTime.count());
+    printf("Culling: every object %.3f ms, BVH %.3f ms (%d drawn, %d mismatches)\n",
+           linearCull.count() / reps, bvhCull.count() / reps, lastDrawn, cullMismatches);
+    printf("Picking: every object %.4f ms, BVH %.4f ms per pick (%d of %d hit, %d mismatches)\n",
+           linearPick.count() / picks, bvhPick.count() / picks, hits, picks, pickMismatches);
+}
+
+//------Level of detail selection---------------------------------------------
+//
+// selectLods picks each visible object's level of detail from the height of
+// its bounding sphere on screen: level l is used below lodPixelSizes[l]
+// pixels.  An object only changes level once its size is lodHysteresis past
+// the threshold, so objects near a threshold don't keep popping between two
+// levels as the camera moves.  The 'l' key tints objects by level (lodColors)
+// to show which level each is drawn with.
+
+const float lodPixelSizes[maxLods] = { 0, 240, 96, 32 };
+const float lodHysteresis = 0.15;
+const vec3 lodColors[maxLods] = { vec3(0.3, 1.0, 0.3), vec3(1.0, 1.0, 0.2),
+                                  vec3(1.0, 0.5, 0.1), vec3(1.0, 0.2, 0.2) };
+
+bool lodSelection = true;          // Cleared by -nolod, which always draws level 0
+bool lodDebug = false;             // Toggled with the 'l' key
+int lastLodCounts[maxLods];        // Objects drawn at each level in the last frame
+long lastTriangles = 0;            // Triangles drawn in the last frame
+
+// The level of detail for an object size pixels high on screen.
+static int lodForSize(float size)
+{
+    int level = 0;
+    while (level+1 < maxLods && size < lodPixelSizes[level+1]) level++;
+    return level;
+}
+
+// The mesh an object is drawn with: its own, or the placeholder while it loads.
+static int drawnMesh(int obj)
+{
+    int meshId = scene.meshId[obj];
+    return meshLoadStates[meshId] == LOADED ? meshId : placeholderMesh;
+}
+
+// The range of indices to draw obj with, at its level of detail, when drawn
+// with mesh meshId.
+static const IndexRange& drawRange(int obj, int meshId)
+{
+    return lodRanges[meshId][min((int)scene.lod[obj], meshLods[meshId]-1)];
+}
+
+// The view depth of the centre of obj's bounding sphere, drawn with mesh
+// meshId.  Expects computeModelViews to have been called for this frame.
+static float viewDepth(int obj, int meshId)
+{
+    const MeshBounds& b = meshBounds[meshId];
+    const float* mv = &modelViews[16*obj];
+    return -(mv[2]*b.center[0] + mv[6]*b.center[1] + mv[10]*b.center[2] + mv[14]);
+}
+
+// Sets scene.lod for the objects in the frustum.  Expects computeModelViews
+// and cullObjects to have been called for this frame.
+static void selectLods()
+{
+    memset(lastLodCounts, 0, sizeof(lastLodCounts));
+    lastTriangles = 0;
+    float pixelsPerUnit = projection[1][1] * windowHeight / 2; // At a distance of 1
+
+    for (int obj=0; obj < nObjects; obj++) {
+        if (!objectInFrustum[obj]) continue;
+        int meshId = drawnMesh(obj);
+
+        int level = 0;
+        if (lodSelection) {
+            float depth = viewDepth(obj, meshId);
+            float radius = meshBounds[meshId].radius * fabsf(scene.scale[obj]);
+            float size = depth > radius ? 2 * radius * pixelsPerUnit / depth : 1e30;
+
+            // Stay at the current level unless the size is well past a threshold
+            int coarsest = lodForSize(size / (1 + lodHysteresis));
+            int finest = lodForSize(size / (1 - lodHysteresis));
+            level = max(finest, min((int)scene.lod[obj], coarsest));
+            level = min(level, meshLods[meshId]-1);
+        }
+        scene.lod[obj] = level;
+        lastLodCounts[level]++;
+        lastTriangles += lodRanges[meshId][level].count / 3;
+    }
+}
+
+// The colour an object's material is multiplied by, to show its level of
+// detail when lodDebug is set.
+static vec3 lodTint(int obj)
+{
+    return lodDebug ? lodColors[scene.lod[obj]] : vec3(1.0, 1.0, 1.0);
+}
+
+static size_t indexSize(GLenum indexType)
+{
+    return indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+}
+
+//Modified for Part[b]
+// The object's model-view matrix, material and texture scale come from its
+// ObjectData record, which must already be selected (see Per-object data).
+void drawMesh(int obj)
+{
+    ProfileScope scope("drawMesh");
+    int texId = scene.texId[obj];
+
+    // Activate a texture, or the placeholder while it is loading.
+    bindTexture(textureIDs[textureReady(texId) ? texId : placeholderTexture]);
+
+    //For rotating view about the vertical axis
+    //glUniformMatrix4fv( rotateView, 1, GL_TRUE, *model); //REMOVE KUSHIL!
+
+    // Activate the VAO for a mesh, or the placeholder while it is loading.
+    int meshId = meshReady(scene.meshId[obj]) ? scene.meshId[obj] : placeholderMesh;
+    CheckError();
+    bindVertexArray( vaoIDs[meshId] );
+    CheckError();
+
+    const IndexRange& range = drawRange(obj, meshId);
+    glDrawElements(GL_TRIANGLES, range.count, indexTypes[meshId],
+                   BUFFER_OFFSET(range.first * indexSize(indexTypes[meshId])));
+    countDraw(range.count, 1);
+    CheckError();
+}
+
+
+//------Per-object data-------------------------------------------------------
+//
+// Each frame the terms the shaders need for each visible object (its
+// model-view matrix and material) are written in one pass into streamBuffer:
+// as InstanceData for instanced drawing (see uploadInstances), or otherwise
+// as an ObjectData record each (see uploadObjects).  The records are grouped
+// into blocks of objectsPerBlock, and each draw picks its record with one
+// glUniform1i of its index in the block bound to ObjectBlock, rather than a
+// glUniform call per term.  Blocks are only rebound every objectsPerBlock
+// draws, since with Mesa at least rebinding a uniform buffer is costlier
+// than setting a uniform.
+//
+// With ARB_buffer_storage streamBuffer is mapped once, persistently, and
+// split into streamFrames regions that are written in turn, so the CPU fills
+// one while the GPU may still be drawing from the others.  A fence after each
+// frame's draws says when its region may be written again.  Without it (or
+// with -nopersistent) the buffer is orphaned and mapped afresh each frame.
+// Either way the buffer grows to fit the scene.
+
+bool persistentStreaming = true;     // Cleared by -nopersistent
+const int streamFrames = 3;
+const int objectsPerBlock = 128;     // Must match OBJECTS_PER_BLOCK in vStart.glsl
+
+GLuint streamBuffer = 0;
+GLsizeiptr streamFrameSize = 0;  // Bytes in each region
+char* streamMapped = NULL;       // The persistent mapping of the whole buffer
+GLsync streamFences[streamFrames];
+int streamFrame = 0;             // The region last written
+bool streamFenceNeeded = false;  // Set once it's written, cleared when it's fenced
+GLint uniformAlignment;          // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+GLuint emptyObjectBuffer;        // Backs ObjectBlock when nothing else is bound
+
+// std140 layout - must match ObjectData in vStart.glsl
+typedef struct {
+    GLfloat modelView[16];      // As in modelViews
+    vec3 ambient;  GLfloat shine;
+    vec3 diffuse;  GLfloat texScale;
+    vec3 specular; GLfloat unused;
+} ObjectData;
+
+GLsizeiptr objectBlockBytes; // A block of records, rounded up to uniformAlignment
+GLintptr objectsOffset;      // Where uploadObjects put this frame's blocks
+int boundObjectBlock;        // The block bound to ObjectBlock, -1 for none this frame
+
+static GLsizeiptr alignUniform(GLsizeiptr size)
+{
+    return (size + uniformAlignment - 1) / uniformAlignment * uniformAlignment;
+}
+
+static void initStreaming()
+{
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+    objectBlockBytes = alignUniform(objectsPerBlock * sizeof(ObjectData));
+
+    if (persistentStreaming && !GLEW_VERSION_4_4 && !GLEW_ARB_buffer_storage) {
+        printf("Persistent mapping needs ARB_buffer_storage, orphaning the per-object buffer instead\n");
+        persistentStreaming = false;
+    }
+    memset(streamFences, 0, sizeof(streamFences));
+    glGenBuffers(1, &streamBuffer);
+
+    // Instanced frames don't read ObjectBlock, but it must still be backed
+    glGenBuffers(1, &emptyObjectBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, emptyObjectBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, objectBlockBytes, NULL, GL_STATIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, objectBlockBinding, emptyObjectBuffer);
+    CheckError();
+}
+
+// Replaces streamBuffer with one whose regions hold at least size bytes.
+// Buffer storage can't be resized, but GL keeps the old buffer until the
+// frames drawn from it are done.
+static void growStreamBuffer(GLsizeiptr size)
+{
+    streamFrameSize = alignUniform(max(size, 2 * streamFrameSize));
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+    if (streamMapped != NULL) glUnmapBuffer(GL_ARRAY_BUFFER);
+    glDeleteBuffers(1, &streamBuffer);
+    glBindBufferBase(GL_UNIFORM_BUFFER, objectBlockBinding, emptyObjectBuffer); // Deleting unbound it
+    for (int f=0; f < streamFrames; f++) {
+        if (streamFences[f] != 0) glDeleteSync(streamFences[f]);
+        streamFences[f] = 0;
+    }
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &streamBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+    glBufferStorage(GL_ARRAY_BUFFER, streamFrames * streamFrameSize, NULL, flags);
+    streamMapped = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, streamFrames * streamFrameSize, flags);
+    if (streamMapped == NULL) {
+        printf("Error - could not map the per-object buffer\n");
+        exit(1);
+    }
+    CheckError();
+}
 
-static void mousePassiveMotion(int x, int y)
+// Returns where to write this frame's size bytes of per-object data, and
+// sets offset to where they start in streamBuffer.  Called at most once a
+// frame, followed by streamUnmapFrame once they're written and then
+// streamFenceFrame once they've been drawn with.
+static char* streamMapFrame(GLsizeiptr size, GLintptr* offset)
 {
-    mouseX=x;
-    mouseY=y;
-}
+    if (!persistentStreaming) {
+        *offset = 0;
+        glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW); // Orphan the last frame's
+        char* p = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size,
+                                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (p == NULL) {
+            printf("Error - could not map the per-object buffer\n");
+            exit(1);
+        }
+        return p;
+    }
 
-//----------------------------------------------------------------------------
+    if (size > streamFrameSize) growStreamBuffer(size);
+    streamFrame = (streamFrame + 1) % streamFrames;
+
+    // Normally long since passed, since it follows the draws of two frames ago
+    GLsync& fence = streamFences[streamFrame];
+    if (fence != 0) {
+        ProfileScope scope("Stream fence wait");
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(fence);
+        fence = 0;
+    }
 
-mat2 camRotZ()
-{
-    return rotZ(-camRotSidewaysDeg) * mat2(10.0, 0, 0, -10.0);
+    streamFenceNeeded = true;
+    *offset = streamFrame * streamFrameSize;
+    return streamMapped + *offset;
 }
 
-//------callback functions for doRotate below and later-----------------------
-
-static void adjustCamrotsideViewdist(vec2 cv)
+// The persistent mapping is coherent, so only the orphaned one needs unmapping.
+static void streamUnmapFrame()
 {
-    cout << cv << endl;
-    camRotSidewaysDeg+=cv[0]; viewDist+=cv[1];
+    if (persistentStreaming) return;
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    CheckError();
 }
 
-static void adjustcamSideUp(vec2 su)
+// Called after this frame's last draw from streamBuffer.
+static void streamFenceFrame()
 {
-    camRotSidewaysDeg+=su[0]; camRotUpAndOverDeg+=su[1];
+    if (!streamFenceNeeded) return;
+    streamFences[streamFrame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    streamFenceNeeded = false;
 }
-    
-static void adjustLocXZ(vec2 xz)
+
+// Writes an ObjectData record for each object in queue, in order, for
+// bindObjectData.  Expects computeModelViews and selectLods to have been
+// called for this frame.
+static void uploadObjects(const vector<RenderItem>& queue)
 {
-    sceneObjs[toolObj].loc[0]+=xz[0]; sceneObjs[toolObj].loc[2]+=xz[1];
+    int n = queue.size();
+    if (n == 0) return;
+
+    int numBlocks = (n + objectsPerBlock - 1) / objectsPerBlock;
+    char* p = streamMapFrame(numBlocks * objectBlockBytes, &objectsOffset);
+    boundObjectBlock = -1;
+    for (int q=0; q < n; q++) {
+        int obj = queue[q].obj;
+        const Material& m = scene.material[obj];
+        ObjectData* data = (ObjectData*)(p + q / objectsPerBlock * objectBlockBytes)
+                         + q % objectsPerBlock;
+
+        vec3 rgb = m.rgb  * m.brightness  * 2.0 * lodTint(obj);
+        memcpy(data->modelView, &modelViews[16*obj], sizeof(data->modelView));
+        data->ambient = m.ambient * rgb;
+        data->shine = m.shine;
+        data->diffuse = m.diffuse * rgb;
+        data->texScale = m.texScale;
+        data->specular = m.specular * rgb;
+        data->unused = 0;
+    }
+    streamUnmapFrame();
 }
 
-static void adjustScaleY(vec2 sy)
+// Selects the record for entry q of the queue given to uploadObjects, for
+// the next draw with the current shader variant.
+static void bindObjectData(int q)
 {
-    sceneObjs[toolObj].scale+=sy[0]; sceneObjs[toolObj].loc[1]+=sy[1];
+    int block = q / objectsPerBlock;
+    if (block != boundObjectBlock) {
+        glBindBufferRange(GL_UNIFORM_BUFFER, objectBlockBinding, streamBuffer,
+                          objectsOffset + block * objectBlockBytes, objectBlockBytes);
+        boundObjectBlock = block;
+    }
+    glUniform1i( uLoc.objectIndex, q % objectsPerBlock );
 }
 
+//------Instanced drawing-----------------------------------------------------
+//
+// Objects sharing a (meshId, texId) pair and level of detail are drawn
+// together with one glDrawElementsInstanced.  Their model matrices and
+// material terms are packed into streamBuffer, which feeds the i* attributes
+// in vStart.glsl.
 
-//----------------------------------------------------------------------------
-//------Set the mouse buttons to rotate the camera----------------------------
-//------around the centre of the scene.---------------------------------------
-//----------------------------------------------------------------------------
+bool instancedDraw = false; // Toggled with the 'i' key
+GLintptr instancesOffset;   // Where uploadInstances put this frame's instances in streamBuffer
 
-static void doRotate()
+typedef struct {
+    mat4 model;  // Transposed, so each row is one column of the model-view matrix
+    vec3 ambient, diffuse, specular;
+    float shine, texScale;
+} InstanceData;
+
+// Points the per-instance attributes of the currently bound VAO at the
+// instances starting at byte offset first in this frame's instances.  The
+// material attributes are left alone unless materials is set.
+static void setInstanceAttribs(GLintptr first, bool materials)
 {
-    setToolCallbacks(adjustCamrotsideViewdist, mat2(400,0,0,-2),
-                     adjustcamSideUp, mat2(400, 0, 0,-90) );
+    GLsizei stride = sizeof(InstanceData);
+    first += instancesOffset;
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+
+    if (iModel >= 0) {
+        for (int col=0; col < 4; col++) {
+            glVertexAttribPointer(iModel+col, 4, GL_FLOAT, GL_FALSE, stride,
+                                  BUFFER_OFFSET(first + offsetof(InstanceData, model) + col*sizeof(vec4)));
+            glVertexAttribDivisor(iModel+col, 1);
+            glEnableVertexAttribArray(iModel+col);
+        }
+    }
+    if (!materials) return;
+
+    GLint attribs[] = { iAmbient, iDiffuse, iSpecular, iShineTexScale };
+    GLint sizes[] = { 3, 3, 3, 2 };
+    size_t offsets[] = { offsetof(InstanceData, ambient), offsetof(InstanceData, diffuse),
+                         offsetof(InstanceData, specular), offsetof(InstanceData, shine) };
+    for (int a=0; a < 4; a++) {
+        if (attribs[a] < 0) continue;
+        glVertexAttribPointer(attribs[a], sizes[a], GL_FLOAT, GL_FALSE, stride,
+                              BUFFER_OFFSET(first + offsets[a]));
+        glVertexAttribDivisor(attribs[a], 1);
+        glEnableVertexAttribArray(attribs[a]);
+    }
+    CheckError();
 }
-                                     
-//------Add an object to the scene--------------------------------------------
 
-static void addObject(int id)
+// Turns instanced drawing on or off.  When it is turned off the instance
+// arrays are disabled again, so the per-object path never reads them.
+static void setInstancedDraw(bool on)
 {
+    instancedDraw = on;
+    printf("Instanced drawing %s\n", instancedDraw ? "on" : "off");
+    if (instancedDraw) return;
+
+    GLint attribs[] = { iModel, iModel+1, iModel+2, iModel+3,
+                        iAmbient, iDiffuse, iSpecular, iShineTexScale };
+    for (int m=0; m <= numMeshes; m++) {
+        if (m != placeholderMesh && meshLoadStates[m] != LOADED) continue;
+        bindVertexArray( vaoIDs[m] );
+        for (int a=0; a < 8; a++)
+            if (attribs[a] >= 0 && (a >= 4 || iModel >= 0))
+                glDisableVertexAttribArray(attribs[a]);
+    }
+    CheckError();
+}
 
-    vec2 currPos = currMouseXYworld(camRotSidewaysDeg);
-    sceneObjs[nObjects].loc[0] = currPos[0];
-    sceneObjs[nObjects].loc[1] = 0.0;
-    sceneObjs[nObjects].loc[2] = currPos[1];
-    sceneObjs[nObjects].loc[3] = 1.0;
+// Packs the model-view matrices and materials of the objects in queue into
+// streamBuffer, for drawInstanced.  Expects computeModelViews to have been
+// called for this frame.
+static void uploadInstances(const vector<RenderItem>& queue)
+{
+    int n = queue.size();
+    if (n == 0) return;
+
+    // Orphaning re-specifies streamBuffer at this frame's size, which may be
+    // smaller than the range ObjectBlock was last bound to
+    glBindBufferBase(GL_UNIFORM_BUFFER, objectBlockBinding, emptyObjectBuffer);
+    boundObjectBlock = -1;
+
+    InstanceData* instances = (InstanceData*)streamMapFrame(sizeof(InstanceData)*n, &instancesOffset);
+    for (int i=0; i < n; i++) {
+        int obj = queue[i].obj;
+        const Material& m = scene.material[obj];
+        InstanceData& inst = instances[i];
+
+        vec3 rgb = m.rgb  * m.brightness  * 2.0 * lodTint(obj);
+        memcpy(&inst.model[0][0], &modelViews[16*obj], sizeof(inst.model));
+        inst.ambient = m.ambient * rgb;
+        inst.diffuse = m.diffuse * rgb;
+        inst.specular = m.specular * rgb;
+        inst.shine = m.shine;
+        inst.texScale = m.texScale;
+    }
+    streamUnmapFrame();
+}
 
-    if (id!=0 && id!=55)
-        sceneObjs[nObjects].scale = 0.005;
+// Draws the objects in queue, one instanced draw call per (meshId, texId,
+// level of detail) group.  Consecutive objects with equal keys form a group,
+// so queue is normally sorted like renderQueue, but any order is drawn
+// correctly.
+// With lit set, each group is drawn with its shader variant, texture and
+// materials.  Otherwise only depth is being drawn, with the current program,
+// so no textures or materials are set up and groups only need to share a mesh
+// and level.  Expects uploadInstances to have been called with queue.
+static void drawInstanced(const vector<RenderItem>& queue, bool lit)
+{
+    int n = queue.size();
+    for (int start=0; start < n; ) {
+        int first = queue[start].obj;
+        int end = start+1;
+        if (lit)
+            while (end < n && queue[end].key == queue[start].key) end++;
+        else
+            while (end < n && depthOnlyKey(queue[end].key) == depthOnlyKey(queue[start].key)) end++;
+
+        if (lit) {
+            useVariant(variantOfKey(queue[start].key));
+            int texId = scene.texId[first];
+            bindTexture(textureIDs[textureReady(texId) ? texId : placeholderTexture]);
+        }
 
-    sceneObjs[nObjects].rgb[0] = 0.7; sceneObjs[nObjects].rgb[1] = 0.7;
-    sceneObjs[nObjects].rgb[2] = 0.7; sceneObjs[nObjects].brightness = 1.0;
+        int meshId = meshReady(scene.meshId[first]) ? scene.meshId[first] : placeholderMesh;
+        bindVertexArray( vaoIDs[meshId] );
+        setInstanceAttribs(start * sizeof(InstanceData), lit);
 
-    sceneObjs[nObjects].diffuse = 1.0; sceneObjs[nObjects].specular = 0.5;
-    sceneObjs[nObjects].ambient = 0.7; sceneObjs[nObjects].shine = 10.0;
+        const IndexRange& range = drawRange(first, meshId);
+        glDrawElementsInstanced(GL_TRIANGLES, range.count, indexTypes[meshId],
+                                BUFFER_OFFSET(range.first * indexSize(indexTypes[meshId])), end - start);
+        countDraw(range.count, end - start);
+        CheckError();
 
-    sceneObjs[nObjects].angles[0] = 0.0; sceneObjs[nObjects].angles[1] = 180.0;
-    sceneObjs[nObjects].angles[2] = 0.0;
+        start = end;
+    }
+}
 
-    sceneObjs[nObjects].meshId = id;
-    sceneObjs[nObjects].texId = rand() % numTextures;
-    sceneObjs[nObjects].texScale = 2.0;
+//------Draw order and depth pre-pass-----------------------------------------
+//
+// The lighting in fStart.glsl is the costliest part of drawing.  Objects are
+// normally drawn in state order (see Render queue), so a pixel may be lit
+// several times before the nearest surface covers it.  Two options reduce
+// that, and can be combined:
+//  - Front-to-back order ('o' key, -fronttoback): visibleQueue is sorted by
+//    the view depth of each object's bounding sphere centre, nearest first,
+//    so the depth test rejects more hidden fragments before they are lit.  It
+//    costs more state changes, and splits up instanced groups.
+//  - A depth pre-pass ('z' key, -depthprepass): the visible objects are first
+//    drawn with depthProgram, which only writes depth, then drawn again with
+//    the lighting shader, testing with GL_LEQUAL and not writing depth.  Only
+//    the nearest surface then passes, so the lighting runs about once per
+//    visible pixel, at the cost of transforming every vertex twice.
+//    gl_Position is invariant in both vertex shaders, so the depths match.
+// With -headless, -benchdepth times all four combinations.
+
+bool frontToBack = false;  // Toggled with the 'o' key, set by -fronttoback
+bool depthPrepass = false; // Toggled with the 'z' key, set by -depthprepass
+GLuint litSamplesQuery = 0; // Occlusion query around the lighting pass, in headless runs
+
+vector<float> objectDepths; // Set by sortFrontToBack
+
+static bool nearerFirst(const RenderItem& a, const RenderItem& b)
+{
+    float da = objectDepths[a.obj], db = objectDepths[b.obj];
+    return da < db || (da == db && a.obj < b.obj);
+}
 
-    toolObj = currObject = nObjects++;
-    setToolCallbacks(adjustLocXZ, camRotZ(),
-                     adjustScaleY, mat2(0.05, 0, 0, 10.0) );
+// Sorts queue by view depth, nearest first.  Expects computeModelViews to
+// have been called for this frame.
+static void sortFrontToBack(vector<RenderItem>& queue)
+{
+    objectDepths.resize(nObjects);
+    for (size_t q=0; q < queue.size(); q++)
+        objectDepths[queue[q].obj] = viewDepth(queue[q].obj, drawnMesh(queue[q].obj));
+    sort(queue.begin(), queue.end(), nearerFirst);
+}
 
+// Draws the objects in queue into the depth buffer only, with depthProgram,
+// then sets the depth test up for drawing them again with the lighting.
+// endDepthPrepass puts it back afterwards.
+// Expects uploadInstances to have been called with queue when instancedDraw
+// is set, and computeModelViews for this frame.
+static void drawDepthPrepass(const vector<RenderItem>& queue)
+{
+    useProgram( depthProgram );
+    glUniformMatrix4fv( depthProjectionU, 1, GL_TRUE, projection );
+    glUniform1i( depthInstancedU, instancedDraw );
+    glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+
+    if (instancedDraw) {
+        glUniformMatrix4fv( depthModelViewU, 1, GL_TRUE, mat4() );
+        drawInstanced(queue, false);
+    }
+    else for (size_t q=0; q < queue.size(); q++) {
+        int obj = queue[q].obj;
+        int meshId = meshReady(scene.meshId[obj]) ? scene.meshId[obj] : placeholderMesh;
+        glUniformMatrix4fv( depthModelViewU, 1, GL_FALSE, &modelViews[16*obj] );
+        bindVertexArray( vaoIDs[meshId] );
+
+        const IndexRange& range = drawRange(obj, meshId);
+        glDrawElements(GL_TRIANGLES, range.count, indexTypes[meshId],
+                       BUFFER_OFFSET(range.first * indexSize(indexTypes[meshId])));
+        countDraw(range.count, 1);
+    }
+    CheckError();
 
-    glutPostRedisplay();
+    glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+    glDepthFunc( GL_LEQUAL );
+    glDepthMask( GL_FALSE );
 }
 
-//------The init function-----------------------------------------------------
-GLuint transformID;
+static void endDepthPrepass()
+{
+    glDepthFunc( GL_LESS );
+    glDepthMask( GL_TRUE ); // Needed for glClear to clear the depth buffer
+}
 
-// Modified for Part[i] and Part[j]
-void init( void )
+// Describes the current draw order and pre-pass setting, for reports.
+static const char* drawStrategyName()
 {
-    srand ( time(NULL) ); /* initialize random seed - so the starting scene varies */
-    aiInit();
+    if (frontToBack) return depthPrepass ? "front-to-back, depth pre-pass" : "front-to-back";
+    return depthPrepass ? "state order, depth pre-pass" : "state order";
+}
 
-    // for (int i=0; i < numMeshes; i++)
-    //     meshes[i] = NULL;
+//------Clustered lighting----------------------------------------------------
+//
+// Lighting every fragment with every light is too slow with hundreds of
+// lights.  Instead the view frustum is divided into clusters: a grid of
+// clusterTilesX x clusterTilesY screen tiles, each cut into clusterSlices by
+// view depth.  The slices are spaced logarithmically between the near and far
+// planes, so distant clusters are deeper.  Each frame binLights lists the
+// point and spot lights whose sphere of influence (see lightRadius) overlaps
+// each cluster, and fStart.glsl lights a fragment with only the lights listed
+// for its cluster, plus the directional lights, which reach everywhere.  With
+// many lights the binning is split by slice between several threads.
+//
+// The lists are uploaded as two texture buffers: clusterLightBuffer holds the
+// start and count of each cluster's lights in lightIndexBuffer.  The 'k' key
+// or -noclusters puts every light in a single cluster instead, for comparison,
+// and -stresslights N starts with a scene lit by N point lights (see
+// initLightStressScene).
 
-    glGenVertexArrays(numMeshes, vaoIDs); CheckError(); // Allocate vertex array objects for meshes
-    glGenTextures(numTextures, textureIDs); CheckError(); // Allocate texture objects
+const int clusterTilesX = 16, clusterTilesY = 9, clusterSlices = 24;
+const int clusterParallelLights = 256; // Bin in parallel from this many point and spot lights
 
-    // Load shaders and use the resulting shader program
-    shaderProgram = InitShader( "vStart.glsl", "fStart.glsl" );
+bool clusteredLighting = true; // Toggled with the 'k' key, cleared by -noclusters
 
-    glUseProgram( shaderProgram ); CheckError();
+GLuint lightDataBuffer, clusterLightBuffer, lightIndexBuffer; // Texture buffer contents
+GLuint lightTextures[3]; // The texture buffers, on lightDataUnit, clusterLightUnit and lightIndexUnit
+GLint maxLightIndices;   // GL_MAX_TEXTURE_BUFFER_SIZE
 
-    // Initialize the vertex position attribute from the vertex shader        
-    vPosition = glGetAttribLocation( shaderProgram, "vPosition" );
-    vNormal = glGetAttribLocation( shaderProgram, "vNormal" ); CheckError();
+vector<GLuint> clusterLights; // Start and count in lightIndices per cluster
+vector<GLuint> lightIndices;  // Lights in lightData, listed per cluster
 
-    // Likewise, initialize the vertex texture coordinates attribute.    
-    vTexCoord = glGetAttribLocation( shaderProgram, "vTexCoord" );
-    CheckError();
+int lastClusterLights, lastMaxClusterLights; // Mean and most lights in an occupied cluster, last frame
 
-    projectionU = glGetUniformLocation(shaderProgram, "Projection");
-    modelViewU = glGetUniformLocation(shaderProgram, "ModelView");
+typedef struct {
+    int light;                  // In lightData
+    int x0, x1, y0, y1, z0, z1; // Inclusive ranges of tiles and slices that it reaches
+} ClusterBounds;
 
-    transformID = glGetUniformLocation(shaderProgram,"rotation");
+// The distance at which brightness times the distance attenuation
+// 1/(1 + 0.14d + 0.07d^2) in fStart.glsl falls to lightCutoff.
+static float lightRadius(float brightness)
+{
+    float c = 1 - brightness / lightCutoff; // Solve 0.07d^2 + 0.14d + c = 0
+    if (c >= 0) return 0;
+    return (-0.14 + sqrt(0.14*0.14 - 4*0.07*c)) / (2*0.07);
+}
 
-    // Objects 0, and 1 are the ground and the first light.
-    addObject(0); // Square for the ground
-    sceneObjs[0].loc = vec4(0.0, 0.0, 0.0, 1.0);
-    sceneObjs[0].scale = 10.0;
-    sceneObjs[0].angles[0] = 90.0; // Rotate it.
-    sceneObjs[0].texScale = 5.0; // Repeat the texture.
+// Allocates the light buffers and attaches the texture buffers to their units.
+static void initLightBuffers()
+{
+    // The uniform buffer is filled each frame by updateLights
+    glGenBuffers(1, &lightBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, lightBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(LightBlockData), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, lightBlockBinding, lightBuffer); CheckError();
+
+    // The cluster lists change size every frame, and are reallocated by binLights
+    GLuint* buffers[3] = { &lightDataBuffer, &clusterLightBuffer, &lightIndexBuffer };
+    GLsizeiptr sizes[3] = { maxLights * sizeof(LightData), 2 * sizeof(GLuint), sizeof(GLuint) };
+    GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+    int units[3] = { lightDataUnit, clusterLightUnit, lightIndexUnit };
+
+    glGenTextures(3, lightTextures);
+    for (int i=0; i < 3; i++) {
+        glGenBuffers(1, buffers[i]);
+        glBindBuffer(GL_TEXTURE_BUFFER, *buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, sizes[i], NULL, GL_DYNAMIC_DRAW);
+
+        glActiveTexture(GL_TEXTURE0 + units[i]);
+        glBindTexture(GL_TEXTURE_BUFFER, lightTextures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], *buffers[i]);
+        CheckError();
+    }
+    glActiveTexture(GL_TEXTURE0);
 
-    addObject(55); // Sphere for the first light
-    sceneObjs[1].loc = vec4(2.0, 1.0, 1.0, 1.0);
-    sceneObjs[1].scale = 0.1;
-    sceneObjs[1].texId = 0; // Plain texture
-    sceneObjs[1].brightness = 0.4; // The light's brightness is 5 times this (below).
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxLightIndices);
+}
 
-    addObject(55); // Sphere for the second light - KV
-    sceneObjs[2].loc = vec4(2.0, 2.0, 1.0, 1.0); // Added height to show in scene
-    sceneObjs[2].scale = 0.1;
-    sceneObjs[2].texId = 0; // Plain texture
-    sceneObjs[2].brightness = 0.2; 
+// Works out the clusters that a sphere of radius r around the eye coordinates
+// c reaches, from the screen rectangle covered by its bounding box and its
+// range of depths.  Returns false if it is outside the view frustum.
+static bool lightClusterBounds(const vec4& c, float r, float nearDepth, float farDepth,
+                               ClusterBounds* b)
+{
+    const GLint* grid = lightBlock.clusterGrid;
+    float minDepth = -c.z - r, maxDepth = -c.z + r;
+    if (maxDepth <= nearDepth || minDepth >= farDepth) return false;
+
+    float sliceScale = lightBlock.clusterMap[2], sliceBias = lightBlock.clusterMap[3];
+    b->z0 = max(0, (int)floor(log(max(minDepth, nearDepth)) * sliceScale + sliceBias));
+    b->z1 = min(grid[2]-1, (int)floor(log(min(maxDepth, farDepth)) * sliceScale + sliceBias));
+
+    b->x0 = 0; b->x1 = grid[0]-1;
+    b->y0 = 0; b->y1 = grid[1]-1;
+    if (minDepth <= nearDepth) return true; // Its projection is unbounded
+
+    float minX = 1, maxX = -1, minY = 1, maxY = -1; // In normalized device coordinates
+    for (int i=0; i < 8; i++) {
+        vec4 corner = projection * vec4(c.x + (i & 1 ? r : -r), c.y + (i & 2 ? r : -r),
+                                        c.z + (i & 4 ? r : -r), 1.0);
+        float x = corner.x / corner.w, y = corner.y / corner.w;
+        minX = min(minX, x); maxX = max(maxX, x);
+        minY = min(minY, y); maxY = max(maxY, y);
+    }
+    if (maxX < -1 || minX > 1 || maxY < -1 || minY > 1) return false;
 
-    addObject(55); // Third rotational light - KV
-    sceneObjs[3].loc = vec4(2.0, 3.0, 1.0, 1.0); // Added height to see in scene
-    sceneObjs[3].scale = 0.1;
-    sceneObjs[3].texId = 0; // Plain texture
-    sceneObjs[3].brightness = 0.2; 
+    b->x0 = max(0, (int)floor((minX + 1) / 2 * grid[0]));
+    b->x1 = min(grid[0]-1, (int)floor((maxX + 1) / 2 * grid[0]));
+    b->y0 = max(0, (int)floor((minY + 1) / 2 * grid[1]));
+    b->y1 = min(grid[1]-1, (int)floor((maxY + 1) / 2 * grid[1]));
+    return true;
+}
 
-    addObject(rand() % numMeshes); // A test mesh
+// Lists the lights in bounds that reach each cluster in slices firstSlice to
+// endSlice-1.  The lists go in indices, one after another, and each cluster's
+// start in indices and count go in clusterLights.  Threads binning different
+// slices write to different parts of clusterLights.
+static void binSlices(int firstSlice, int endSlice, const vector<ClusterBounds>* bounds,
+                      vector<GLuint>* indices)
+{
+    const GLint* grid = lightBlock.clusterGrid;
+    int sliceSize = grid[0] * grid[1];
+    GLuint* cluster = &clusterLights[2 * firstSlice * sliceSize]; // Start, count pairs
+    int numClusters = (endSlice - firstSlice) * sliceSize;
+    for (int i=0; i < numClusters; i++) cluster[2*i+1] = 0;
+
+    // Count the lights in each cluster, make room for them, then list them
+    for (int pass=0; pass < 2; pass++) {
+        for (size_t l=0; l < bounds->size(); l++) {
+            const ClusterBounds& b = (*bounds)[l];
+            for (int z = max(b.z0, firstSlice); z <= min(b.z1, endSlice-1); z++)
+                for (int y = b.y0; y <= b.y1; y++)
+                    for (int x = b.x0; x <= b.x1; x++) {
+                        GLuint* c = &cluster[2 * (((z - firstSlice) * grid[1] + y) * grid[0] + x)];
+                        if (pass == 1) (*indices)[c[0] + c[1]] = b.light;
+                        c[1]++;
+                    }
+        }
 
-    // We need to enable the depth test to discard fragments that
-    // are behind previously drawn fragments for the same pixel.
-    glEnable( GL_DEPTH_TEST );
-    doRotate(); // Start in camera rotate mode.
-    glClearColor( 0.0, 0.0, 0.0, 1.0 ); /* black background */
+        if (pass == 1) break;
+        GLuint start = 0;
+        for (int i=0; i < numClusters; i++) {
+            cluster[2*i] = start;
+            start += cluster[2*i+1];
+            cluster[2*i+1] = 0;
+        }
+        indices->resize(start);
+    }
 }
 
-//----------------------------------------------------------------------------
+// binLights shares the slices between the GL thread and a pool of binning
+// threads, which wait on binCond between frames.  The pool is started the
+// first time there are enough lights to need it, and joined at exit like the
+// loader threads.  The frame's lights and the number of threads to use are
+// set before binFrame is bumped, and are left alone until every thread taking
+// part has finished.
+
+mutex binMutex; // Guards binFrame, binBusy and stopBinning
+condition_variable binCond, binDoneCond;
+vector<thread> binThreads;
+unsigned int binFrame = 0; // Bumped when there are slices to bin
+int binBusy = 0;           // Threads still binning this frame's slices
+bool stopBinning = false;
+
+vector<ClusterBounds> binBounds;       // The lights to bin, in view of the clusters
+vector<vector<GLuint> > threadIndices; // Each thread's lists, for binLights to join
+int binNumThreads = 1;                 // Threads binning this frame, including the GL thread
+
+// Thread t's share of the slices.
+static void binShare(int t)
+{
+    int slices = lightBlock.clusterGrid[2];
+    binSlices(slices * t / binNumThreads, slices * (t+1) / binNumThreads, &binBounds, &threadIndices[t]);
+}
 
-//Modified for Part[b]
-void drawMesh(SceneObject sceneObj)
+static void binThreadMain(int t)
 {
+    unsigned int lastFrame = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> lock(binMutex);
+            while (binFrame == lastFrame && !stopBinning) binCond.wait(lock);
+            if (stopBinning) return;
+            lastFrame = binFrame;
+            if (t >= binNumThreads) continue; // Not needed this frame
+        }
 
-    // Activate a texture, loading if needed.
-    loadTextureIfNotAlreadyLoaded(sceneObj.texId);
-    glActiveTexture(GL_TEXTURE0 );
-    glBindTexture(GL_TEXTURE_2D, textureIDs[sceneObj.texId]);
+        binShare(t);
 
-    // Texture 0 is the only texture type in this program, and is for the rgb
-    // colour of the surface but there could be separate types for, e.g.,
-    // specularity and normals.
-    glUniform1i( glGetUniformLocation(shaderProgram, "texture"), 0 );
+        lock_guard<mutex> lock(binMutex);
+        if (--binBusy == 0) binDoneCond.notify_one();
+    }
+}
 
-    // Set the texture scale for the shaders
-    glUniform1f( glGetUniformLocation( shaderProgram, "texScale"), sceneObj.texScale ); // For shaders? texScale isn't there?
+// Called at exit, as for stopLoaderThreads.
+static void stopBinThreads()
+{
+    {
+        lock_guard<mutex> lock(binMutex);
+        stopBinning = true;
+    }
+    binCond.notify_all();
+    for (size_t i=0; i < binThreads.size(); i++)
+        binThreads[i].join();
+}
 
-    // Set the projection matrix for the shaders
-    glUniformMatrix4fv( projectionU, 1, GL_TRUE, projection );
+// Bins binBounds into the clusters with numThreads threads, the GL thread
+// included, starting the pool if need be.
+static void binInParallel(int numThreads)
+{
+    if (numThreads > 1 && binThreads.empty()) {
+        int poolSize = max(1, min((int)thread::hardware_concurrency(), clusterSlices));
+        for (int t=1; t < poolSize; t++)
+            binThreads.push_back(thread(binThreadMain, t));
+        atexit(stopBinThreads);
+    }
+    numThreads = min(numThreads, (int)binThreads.size() + 1);
+
+    binNumThreads = numThreads;
+    threadIndices.resize(max((size_t)numThreads, threadIndices.size()));
+    if (numThreads > 1) {
+        {
+            lock_guard<mutex> lock(binMutex);
+            binBusy = numThreads - 1;
+            binFrame++;
+        }
+        binCond.notify_all();
+    }
 
+    binShare(0);
 
-    // Set the model matrix - this should combine translation, rotation and scaling based on what's
-    // in the sceneObj structure (see near the top of the program).
-    
-    //Form angles matrix to manipulate mesh
-    // Part[b]
+    unique_lock<mutex> lock(binMutex);
+    while (binBusy > 0) binDoneCond.wait(lock);
+}
 
-    mat4 xRotation = RotateX(sceneObj.angles[0]);
-    mat4 yRotation = RotateY(sceneObj.angles[1]);
-    mat4 zRotation = RotateZ(sceneObj.angles[2]);
-    mat4 rotationMatrix = xRotation * yRotation * zRotation; // Matrix for manipulating the rotation matrix.
+// Bins the point and spot lights in lightData into clusters and uploads the
+// lists.  Sets the cluster fields of lightBlock, which fStart.glsl uses to
+// find each fragment's cluster.
+static void binLights()
+{
+    GLint* grid = lightBlock.clusterGrid;
+    grid[0] = clusteredLighting ? clusterTilesX : 1;
+    grid[1] = clusteredLighting ? clusterTilesY : 1;
+    grid[2] = clusteredLighting ? clusterSlices : 1;
+
+    // The near and far plane distances, from the projection matrix
+    float nearDepth = projection[2][3] / (projection[2][2] - 1);
+    float farDepth = projection[2][3] / (projection[2][2] + 1);
+
+    lightBlock.clusterMap[0] = (float)windowWidth / grid[0];
+    lightBlock.clusterMap[1] = (float)windowHeight / grid[1];
+    lightBlock.clusterMap[2] = grid[2] / log(farDepth / nearDepth);
+    lightBlock.clusterMap[3] = -log(nearDepth) * lightBlock.clusterMap[2];
+
+    vector<ClusterBounds>& bounds = binBounds;
+    bounds.clear();
+    for (int l = numDirectionalLights; l < (int)lightData.size(); l++) {
+        ClusterBounds b = { l, 0, grid[0]-1, 0, grid[1]-1, 0, grid[2]-1 };
+        if (lightData[l].range[1] <= 0) continue; // Too dim to light anything
+        if (!clusteredLighting ||
+            lightClusterBounds(lightData[l].position, lightData[l].range[1], nearDepth, farDepth, &b))
+            bounds.push_back(b);
+    }
 
-    // Final matrix required for transformation.
-    mat4 model = Translate(sceneObj.loc) * rotationMatrix * Scale(sceneObj.scale);
+    // Split the slices between threads, each listing its lights separately
+    int numThreads = 1;
+    if ((int)bounds.size() >= clusterParallelLights)
+        numThreads = max(1, min((int)thread::hardware_concurrency(), (int)grid[2]));
+
+    int sliceSize = grid[0] * grid[1];
+    clusterLights.resize(2 * sliceSize * grid[2]);
+    binInParallel(numThreads);
+    numThreads = binNumThreads;
+
+    // Join the lists, moving each thread's starts past the lists before it.
+    // The clusters are listed in slice order, so each thread's are together.
+    lightIndices.clear();
+    int occupied = 0;
+    lastMaxClusterLights = 0;
+    for (int t=0; t < numThreads; t++) {
+        int firstCluster = sliceSize * (grid[2] * t / numThreads);
+        int endCluster = sliceSize * (grid[2] * (t+1) / numThreads);
+        for (int c = firstCluster; c < endCluster; c++) {
+            clusterLights[2*c] += lightIndices.size();
+            int count = clusterLights[2*c+1];
+            occupied += count > 0;
+            lastMaxClusterLights = max(lastMaxClusterLights, count);
+
+            // The texture buffer has a limited size, only guaranteed to be 65536
+            if (clusterLights[2*c] + count > (GLuint)maxLightIndices)
+                clusterLights[2*c+1] = max(0, maxLightIndices - (int)clusterLights[2*c]);
+        }
+        lightIndices.insert(lightIndices.end(), threadIndices[t].begin(), threadIndices[t].end());
+    }
+    lastClusterLights = occupied > 0 ? (lightIndices.size() + occupied/2) / occupied : 0;
+    if ((int)lightIndices.size() > maxLightIndices) {
+        static bool reported = false;
+        if (!reported)
+            printf("The cluster light lists need %d entries, but texture buffers hold %d;"
+                   " lights past that are left out\n", (int)lightIndices.size(), maxLightIndices);
+        reported = true;
+        lightIndices.resize(maxLightIndices);
+    }
 
+    glBindBuffer(GL_TEXTURE_BUFFER, clusterLightBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, clusterLights.size() * sizeof(GLuint), &clusterLights[0],
+                 GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, lightIndexBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, max((size_t)1, lightIndices.size()) * sizeof(GLuint),
+                 lightIndices.empty() ? NULL : &lightIndices[0], GL_STREAM_DRAW);
+    CheckError();
+}
 
-    // Set the model-view matrix for the shaders
-    glUniformMatrix4fv( modelViewU, 1, GL_TRUE, view * model );
+//----------------------------------------------------------------------------
 
-    //For rotating view about the vertical axis
-    //glUniformMatrix4fv( rotateView, 1, GL_TRUE, *model); //REMOVE KUSHIL!
+// Packs every light in the scene into lightData, directional lights first,
+// and uploads it along with the cluster lists and lightBlock.  Lights that
+// are switched off (zero brightness) are left out.  Also sets sceneVariant.
+// viewRotation is the rotational part of the view matrix, used for
+// directional lights.
+static void updateLights(const mat4& viewRotation)
+{
+    lightData.clear();
+    vec3 ambient(0.0, 0.0, 0.0);
+    bool anySpotLights = false;
+    for (int pass=0; pass < 2; pass++) { // Directional lights, then the rest
+        for (int i=0; i < nObjects && (int)lightData.size() < maxLights; i++) {
+            int lightType = scene.lightType[i];
+            if (lightType == LIGHT_NONE || (lightType == LIGHT_DIRECTIONAL) != (pass == 0)) continue;
+            if (scene.material[i].brightness <= 0) continue;
+            anySpotLights |= lightType == LIGHT_SPOT;
+
+            LightData light;
+            if (lightType == LIGHT_DIRECTIONAL)
+                light.position = viewRotation * scene.loc[i];
+            else
+                light.position = view * scene.loc[i];
+
+            const Material& m = scene.material[i];
+            light.color = vec4(m.rgb * m.brightness, m.brightness);
+            ambient += m.rgb * m.brightness;
+
+            // The spotlight direction is worked out here once per frame rather
+            // than per fragment.  angles[1] is its pitch and angles[2] its yaw.
+            float spotPitch = scene.angles[i][1] * DegreesToRadians;
+            float spotYaw = scene.angles[i][2] * DegreesToRadians;
+            light.spot = vec4(cos(spotYaw)*cos(spotPitch), sin(spotPitch),
+                              sin(spotYaw)*cos(spotPitch), spotCutoff);
+
+            float radius = lightType == LIGHT_DIRECTIONAL ? 0.0 : lightRadius(m.brightness);
+            light.range = vec4(lightType, radius, 0.0, 0.0);
+            lightData.push_back(light);
+        }
+        if (pass == 0) numDirectionalLights = lightData.size();
+    }
 
-    // Activate the VAO for a mesh, loading if needed.
-    loadMeshIfNotAlreadyLoaded(sceneObj.meshId);
-    CheckError();
-    glBindVertexArray( vaoIDs[sceneObj.meshId] );
-    CheckError();
+    // Only the lights in use need to be sent
+    if (!lightData.empty()) {
+        glBindBuffer(GL_TEXTURE_BUFFER, lightDataBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, lightData.size() * sizeof(LightData), &lightData[0]);
+    }
 
-    glDrawElements(GL_TRIANGLES, meshes[sceneObj.meshId]->mNumFaces * 3,
-                   GL_UNSIGNED_INT, NULL);
-    CheckError();
-}
+    binLights();
 
+    int directional = min(numDirectionalLights, maxVariantDirectional + 1);
+    sceneVariant = directional << 3 | (anySpotLights ? VARIANT_SPOT_LIGHTS : 0)
+                 | ((int)lightData.size() > numDirectionalLights ? VARIANT_CLUSTERED_LIGHTS : 0);
 
-//----------------------------------------------------------------------------
+    lightBlock.ambient = vec4(ambient, 0.0);
+    lightBlock.clusterGrid[3] = numDirectionalLights;
+    glBindBuffer(GL_UNIFORM_BUFFER, lightBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightBlockData), &lightBlock);
+    CheckError();
+}
 
 // Modified for Part[a]
 // Modified for Part[i]
 // Modified for Part[h]
 void display( void )
 {
+    profileBeginFrame();
+    ProfileScope displayScope("display");
     numDisplayCalls++;
+    variantFrame++;
+    redrawNeeded = false;
+
+    uploadFinishedLoads(); // Meshes and textures from the loader threads
+    updateShaderReload();
 
     glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
     CheckError(); // May report a harmless GL_INVALID_OPERATION with GLEW on the first frame
@@ -432,73 +5534,72 @@ void display( void )
     //glUniformMatrix3fv(transformID, 1, GL_FALSE, mTransform);
     //Rotation
 
-    // Light 1
-    SceneObject lightObj1 = sceneObjs[1]; 
-    vec4 lightPosition = view * lightObj1.loc;
-
-    // Light 2 is independent of the light sources position, therefore we take into account the camera as it is moved 
-    // around the frame i.e yaw and pitch.
-    mat4 light_2_movement = pitch * yaw;
-    SceneObject light_2 = sceneObjs[2];
-    vec4 light_2_pos = light_2_movement * light_2.loc;
-
-    // Light 3
-    SceneObject lightObj3 = sceneObjs[3];
-    float light_pitch = lightObj3.angles[1]; //Equivalent to pitch of light 
-    float light_yaw = lightObj3.angles[2]; //Equivalent to yaw of light
-    vec4 light_3_pos = view * lightObj3.loc;
-
-
-
-    glUniform4fv( glGetUniformLocation(shaderProgram, "LightPosition"), 1, lightPosition);
-    CheckError();
-
-    glUniform4fv( glGetUniformLocation(shaderProgram, "Light_2_Position"), 1, light_2_pos);
-    CheckError();
-
-    glUniform4fv( glGetUniformLocation(shaderProgram, "Light_3_Position"), 1, light_3_pos);
-    CheckError();
-
-    // For Part[h]
-    glUniform1f(glGetUniformLocation(shaderProgram,"brightness"), lightObj1.brightness);
-    CheckError();
-
-    glUniform1f(glGetUniformLocation(shaderProgram, "brightness_2"), light_2.brightness);
-    CheckError();
-    
-    glUniform1f(glGetUniformLocation(shaderProgram, "brightness_3"), lightObj3.brightness);
-    CheckError();
-
-    glUniform1f(glGetUniformLocation(shaderProgram, "pitch"), light_pitch);
-    CheckError();
-
-    glUniform1f(glGetUniformLocation(shaderProgram, "yaw"), light_yaw);
-    CheckError();
+    // Directional lights are independent of the camera's position, so they
+    // only take into account the camera's yaw and pitch.
+    {
+        ProfileScope scope("updateLights");
+        updateLights(pitch * yaw);
+    }
+    {
+        ProfileScope scope("Prepare draws"); // Transforms, culling, LOD and sorting
+        computeModelViews(view);
+        updateBVH();
+        cullObjects(projection * view);
+        selectLods(); // Before updateRenderQueue, whose keys include the level
+        updateRenderQueue();
+        cullRenderQueue();
+        if (frontToBack) sortFrontToBack(visibleQueue);
+    }
 
-    glUniform3fv(glGetUniformLocation(shaderProgram, "color_1"),1, lightObj1.rgb);
-    CheckError();
+    if (instancedDraw) {
+        ProfileScope scope("uploadInstances");
+        uploadInstances(visibleQueue);
+    }
+    else {
+        ProfileScope scope("uploadObjects");
+        uploadObjects(visibleQueue);
+    }
+    if (depthPrepass) {
+        ProfileScope scope("drawDepthPrepass");
+        gpuTimerBegin(GPU_DEPTH_PREPASS);
+        drawDepthPrepass(visibleQueue);
+        gpuTimerEnd();
+    }
 
-    glUniform3fv(glGetUniformLocation(shaderProgram, "color_2"),1, light_2.rgb);
-    CheckError();
+    // Headless runs count the fragments that pass the depth test and so are lit
+    if (headless) {
+        if (litSamplesQuery == 0) glGenQueries(1, &litSamplesQuery);
+        glBeginQuery(GL_SAMPLES_PASSED, litSamplesQuery);
+    }
 
-    glUniform3fv(glGetUniformLocation(shaderProgram, "color_3"),1, lightObj3.rgb);
-    CheckError();
+    // Each shader variant's projection matrix (and the rest of its per-frame
+    // uniforms) is set by useVariant when the variant is first used
+    gpuTimerBegin(GPU_LIT_PASS);
+    if (instancedDraw) {
+        ProfileScope scope("drawInstanced");
+        drawInstanced(visibleQueue, true);
+    }
+    else for (size_t q=0; q < visibleQueue.size(); q++) {
+        {
+            ProfileScope scope("Object uniforms");
+            useVariant(variantOfKey(visibleQueue[q].key));
+            bindObjectData(q); // Written by uploadObjects
+        }
 
-    for (int i=0; i < nObjects; i++) {
-        SceneObject so = sceneObjs[i];
+        drawMesh(visibleQueue[q].obj);
+    }
+    gpuTimerEnd();
+    streamFenceFrame();
 
-        vec3 rgb = so.rgb  * so.brightness  * 2.0;
-        glUniform3fv( glGetUniformLocation(shaderProgram, "AmbientProduct"), 1, so.ambient * rgb );
-        CheckError();
-        glUniform3fv( glGetUniformLocation(shaderProgram, "DiffuseProduct"), 1, so.diffuse * rgb );
-        glUniform3fv( glGetUniformLocation(shaderProgram, "SpecularProduct"), 1, so.specular * rgb );
-        glUniform1f( glGetUniformLocation(shaderProgram, "Shininess"), so.shine );
-        CheckError();
+    if (headless) glEndQuery(GL_SAMPLES_PASSED);
+    if (depthPrepass) endDepthPrepass();
 
-        drawMesh(sceneObjs[i]);
+    drawProfileOverlay();
+    if (!headless) {
+        ProfileScope scope("glutSwapBuffers");
+        glutSwapBuffers();
     }
-
-    glutSwapBuffers();
+    profileEndFrame();
 }
 
 //----------------------------------------------------------------------------
@@ -515,62 +5616,66 @@ static void texMenu(int id)
 {
     deactivateTool();
     if (currObject>=0) {
-        sceneObjs[currObject].texId = id;
-        glutPostRedisplay();
+        scene.texId[currObject] = id;
+        textureReady(id); // Start loading it
+        postRedisplay();
     }
 }
 
 static void groundMenu(int id)
 {
     deactivateTool();
-    sceneObjs[0].texId = id;
-    glutPostRedisplay();
+    scene.texId[0] = id;
+    textureReady(id);
+    postRedisplay();
 }
 
 // Modified to ensure brightness doesn't go below 0.
 static void adjustBrightnessY(vec2 by)
 {
-    sceneObjs[toolObj].brightness+=by[0];
-    if(sceneObjs[toolObj].brightness<=0){
-        sceneObjs[toolObj].brightness=0;
+    scene.material[toolObj].brightness+=by[0];
+    if(scene.material[toolObj].brightness<=0){
+        scene.material[toolObj].brightness=0;
     }
-    sceneObjs[toolObj].loc[1]+=by[1];
+    scene.loc[toolObj][1]+=by[1];
+    markMoved(toolObj);
 }
 
 static void adjustRedGreen(vec2 rg)
 {
-    sceneObjs[toolObj].rgb[0]+=rg[0];
-    sceneObjs[toolObj].rgb[1]+=rg[1];
+    scene.material[toolObj].rgb[0]+=rg[0];
+    scene.material[toolObj].rgb[1]+=rg[1];
 }
 
 static void adjustBlueBrightness(vec2 bl_br)
 {
-    sceneObjs[toolObj].rgb[2]+=bl_br[0];
-    sceneObjs[toolObj].brightness+=bl_br[1];
+    scene.material[toolObj].rgb[2]+=bl_br[0];
+    scene.material[toolObj].brightness+=bl_br[1];
 }
 
 // Code for Part[c]
 // This is a helper function, which works to modify the Ambience and Diffuse of the program
 // when selected. This function is called in the materialMenu function.
 static void AmbientDiffuseModification(vec2 ambdif) {
-    sceneObjs[toolObj].ambient +=  ambdif[0];
-    sceneObjs[toolObj].diffuse +=  ambdif[1];
+    scene.material[toolObj].ambient +=  ambdif[0];
+    scene.material[toolObj].diffuse +=  ambdif[1];
 }
 
 // Code for Part[c]
 // This is a helper function, which works to modify the Specular and Shine of the program
 // when selected. This function is called in the materialMenu function.
 static void SpecularShineModification(vec2 specshi) {
-    sceneObjs[toolObj].specular += specshi[0];
-    sceneObjs[toolObj].shine += specshi[1];
+    scene.material[toolObj].specular += specshi[0];
+    scene.material[toolObj].shine += specshi[1];
 }
 
 //Code for Part[j]
 //Rotates light
 static void RotateObj(vec2 xz)
 {
-    sceneObjs[toolObj].angles[2]+=-20*xz[0]; 
-    sceneObjs[toolObj].angles[1]+=-20*xz[1];
+    scene.angles[toolObj][2]+=-20*xz[0]; 
+    scene.angles[toolObj][1]+=-20*xz[1];
+    markMoved(toolObj);
 }
 
 // Modified for Part[i]
@@ -680,14 +5785,16 @@ static void materialMenu(int id)
 
 static void adjustAngleYX(vec2 angle_yx)
 {
-    sceneObjs[currObject].angles[1]+=angle_yx[0];
-    sceneObjs[currObject].angles[0]+=angle_yx[1];
+    scene.angles[currObject][1]+=angle_yx[0];
+    scene.angles[currObject][0]+=angle_yx[1];
+    markMoved(currObject);
 }
 
 static void adjustAngleZTexscale(vec2 az_ts)
 {
-    sceneObjs[currObject].angles[2]+=az_ts[0];
-    sceneObjs[currObject].texScale+=az_ts[1];
+    scene.angles[currObject][2]+=az_ts[0];
+    scene.material[currObject].texScale+=az_ts[1];
+    markMoved(currObject);
 }
 
 static void mainmenu(int id)
@@ -704,6 +5811,7 @@ static void mainmenu(int id)
         setToolCallbacks(adjustAngleYX, mat2(400, 0, 0, -400),
                          adjustAngleZTexscale, mat2(400, 0, 0, 15) );
     }
+    if (id == 98) saveScene(saveSceneFileName);
     if (id == 99) exit(0);
 }
 
@@ -730,18 +5838,20 @@ static void manipulate_objs(int id){
         vec2 currPos = currMouseXYworld(camRotSidewaysDeg);
         int duplicate_object_pos = selected_object - 200; // Reverse offset
 
-        sceneObjs[nObjects] = sceneObjs[duplicate_object_pos];
-        sceneObjs[nObjects].loc[0] = currPos[0]+ 0.01; // Offsets position of new object to demonstrate it has been duplicated.
-        sceneObjs[nObjects].loc[2] = currPos[1] + 0.01; // Offsets position of new object to demonstrate it has been duplicated.
+        int obj = newSceneObject();
+        copySceneObject(obj, duplicate_object_pos);
+        scene.loc[obj][0] = currPos[0]+ 0.01; // Offsets position of new object to demonstrate it has been duplicated.
+        scene.loc[obj][2] = currPos[1] + 0.01; // Offsets position of new object to demonstrate it has been duplicated.
+        markMoved(obj);
 
         // Essentially replicating function to add new object to scene.
-        toolObj = currObject = nObjects++;
+        toolObj = currObject = obj;
         setToolCallbacks(adjustLocXZ, camRotZ(),
                      adjustScaleY, mat2(0.05, 0, 0, 10.0) );
 
         selected_object = 0; // No object is now selected.
 
-        glutPostRedisplay();
+        postRedisplay();
     }
 
     if(id == 67){ // Delete Object
@@ -751,17 +5861,7 @@ static void manipulate_objs(int id){
             return;
         }
 
-        if((selected_object - 200) != (nObjects-1)){
-            for(int i=0 ; i<((nObjects-1)-(selected_object-200)+1); i++){
-                sceneObjs[selected_object-200+i] = sceneObjs[selected_object-200+1+i]; //Shuffle items to keep indexing correct.
-            }
-        }
-
-        else if((selected_object - 200) == (nObjects-1)){
-            sceneObjs[selected_object-200] = sceneObjs[selected_object-200+1];
-        }
-
-        nObjects = nObjects - 1;
+        eraseSceneObject(selected_object - 200); // Shuffles later objects down to keep indexing correct.
         if(nObjects>4){
             select_object(nObjects-1+200);
             doRotate();
@@ -774,7 +5874,7 @@ static void manipulate_objs(int id){
             doRotate();
         }
     
-        glutPostRedisplay();
+        postRedisplay();
 
     }
 }
@@ -788,6 +5888,7 @@ static void menu_status(int status, int x, int y)
     
     else{
         menu_in_use = 0;
+        postRedisplay(); // For whatever the menu entry changed
     }
 }
 
@@ -810,12 +5911,12 @@ static void makeMenu()
 
     for(int i=4; i < nObjects; i++){
         char fig_name[248];
-        strcpy(fig_name, objectMenuEntries[sceneObjs[i].meshId-1]); 
+        strcpy(fig_name, objectMenuEntries[scene.meshId[i]-1]); 
         // Ensures that original name is not manipulated. 
         int new_objects_id = i+200; // corresponds to actual objects in array + 200+4
         //Shifted by 200, to account for other objects which may be in scene.
         // Also account for fact that other items have high id's.
-        glutAddMenuEntry(strcat(fig_name, textureMenuEntries[sceneObjs[i].texId-1]), new_objects_id); // Makes object easy to identify from scene.
+        glutAddMenuEntry(strcat(fig_name, textureMenuEntries[scene.texId[i]-1]), new_objects_id); // Makes object easy to identify from scene.
 
      }
 
@@ -847,6 +5948,7 @@ static void makeMenu()
     glutAddSubMenu("Manipulate Object", manipulate_objects_id);
 
 
+    glutAddMenuEntry("Save Scene", 98);
     glutAddMenuEntry("EXIT", 99);
     glutAttachMenu(GLUT_RIGHT_BUTTON);
     glutMenuStateFunc(menu_status); //Helps prevent error when refreshing menu
@@ -867,13 +5969,51 @@ void up_func(int key, int x, int y){
 }
 //----------------------------------------------------------------------------
 
+static void setRedrawMode(bool continuous);
+
 void keyboard( unsigned char key, int x, int y )
 {
     switch ( key ) {
         case 033:
             exit( EXIT_SUCCESS );
             break;
+        case 'i': // Switch between per-object and instanced drawing
+            setInstancedDraw(!instancedDraw);
+            break;
+        case 's': // Save the scene (see Scene files)
+            saveScene(saveSceneFileName);
+            break;
+        case 'f': // Switch frustum culling on and off
+            frustumCulling = !frustumCulling;
+            printf("Frustum culling %s\n", frustumCulling ? "on" : "off");
+            break;
+        case 'l': // Show each object's level of detail by its colour
+            lodDebug = !lodDebug;
+            printf("Level of detail colours %s\n", lodDebug ? "on" : "off");
+            break;
+        case 'o': // Switch between state order and front-to-back order
+            frontToBack = !frontToBack;
+            printf("Drawing in %s\n", drawStrategyName());
+            break;
+        case 'z': // Switch the depth pre-pass on and off
+            depthPrepass = !depthPrepass;
+            printf("Drawing in %s\n", drawStrategyName());
+            break;
+        case 'k': // Switch clustered lighting on and off
+            clusteredLighting = !clusteredLighting;
+            printf("Clustered lighting %s\n", clusteredLighting ? "on" : "off");
+            break;
+        case 'p': // Switch the profiling overlay on and off, and profiling unless tracing
+            profileOverlay = !profileOverlay;
+            profiling = profileOverlay || traceFileName != NULL;
+            printf("Profiling overlay %s\n", profileOverlay ? "on" : "off");
+            break;
+        case 'c': // Switch between continuous and on-demand redrawing
+            setRedrawMode(!continuousRedraw);
+            printf("%s redrawing\n", continuousRedraw ? "Continuous" : "On-demand");
+            break;
     }
+    postRedisplay();
 }
 
 //----------------------------------------------------------------------------
@@ -883,6 +6023,25 @@ void idle( void )
     glutPostRedisplay();
 }
 
+// Draws a frame if one is needed, see Redrawing near the top.
+static void redrawTick(int unused)
+{
+    if (continuousRedraw || redrawNeeded || loadsInFlight() || shaderReloadPending())
+        glutPostRedisplay();
+    else
+        skippedTicks++;
+
+    glutTimerFunc(max(1, 1000 / (fpsCap > 0 ? fpsCap : 60)), redrawTick, 0);
+}
+
+// idle() is only installed for continuous redrawing with no cap.
+static void setRedrawMode(bool continuous)
+{
+    continuousRedraw = continuous;
+    glutIdleFunc(continuousRedraw && fpsCap == 0 ? idle : NULL);
+    postRedisplay();
+}
+
 //----------------------------------------------------------------------------
 
 //Modified Part[d]
@@ -922,19 +6081,38 @@ void reshape( int width, int height )
                     -nearDist, nearDist,
                     0.01, 100.0);
     }
+    postRedisplay();
 }
 
 //----------------------------------------------------------------------------
 
 void timer(int unused)
 {
-    char title[256];
-    sprintf(title, "%s %s: %d Frames Per Second @ %d x %d",
-                    lab, programName, numDisplayCalls, windowWidth, windowHeight );
+    char title[512];
+    BindCounters& bc = bindCounters;
+    sprintf(title, "%s %s: %d Frames Per Second (%d idle ticks skipped) @ %d x %d - %d drawn, %d culled"
+                   " - LOD %d/%d/%d/%d, %ld triangles - %d lights, %d/%d per cluster"
+                   " - binds %d issued, %d elided - %d matrices recomputed",
+                    lab, programName, numDisplayCalls, skippedTicks, windowWidth, windowHeight,
+                    lastDrawn, lastCulled,
+                    lastLodCounts[0], lastLodCounts[1], lastLodCounts[2], lastLodCounts[3], lastTriangles,
+                    (int)lightData.size(), lastClusterLights, lastMaxClusterLights,
+                    bc.programBinds + bc.textureBinds + bc.vaoBinds,
+                    bc.programsElided + bc.texturesElided + bc.vaosElided, modelsComputed );
+
+    double cpu[3], gpu[3]; // See Profiling
+    if (profiling && historyPercentiles(cpu, gpu))
+        sprintf(title + strlen(title), " - frame p50/p95/p99 %.1f/%.1f/%.1f ms, GPU %.1f/%.1f/%.1f ms"
+                                       " - %d draw calls, %ld triangles",
+                cpu[0], cpu[1], cpu[2], gpu[0], gpu[1], gpu[2],
+                lastFrameCounters.drawCalls, lastFrameCounters.triangles);
 
     glutSetWindowTitle(title);
 
     numDisplayCalls = 0;
+    skippedTicks = 0;
+    memset(&bindCounters, 0, sizeof(bindCounters));
+    modelsComputed = 0;
     glutTimerFunc(1000, timer, 1);
 }
 
@@ -955,6 +6133,170 @@ void fileErr(char* fileName)
 
 //----------------------------------------------------------------------------
 
+//------Headless rendering----------------------------------------------------
+//
+// With -headless N the scene is rendered N times into an offscreen
+// framebuffer, through an EGL context that needs no window or display server
+// (e.g. Mesa's llvmpipe on a machine without a GPU), and then the program
+// exits.  Every frame is timed, optionally into a CSV file (-csv), and can be
+// saved as a PPM image (-dump) for image-diff regression checks.  The random
+// seed defaults to 1 so that runs are repeatable.  With -benchdepth the frames
+// are drawn with each draw order and depth pre-pass setting in turn (see Draw
+// order and depth pre-pass), to compare them.
+
+int headlessFrames = 0;        // Set by -headless
+const char* csvFileName = NULL; // Set by -csv
+const char* dumpDir = NULL;     // Set by -dump
+bool benchDepth = false;       // Set by -benchdepth
+
+// Creates a surfaceless OpenGL 3.2 core context with a width x height
+// framebuffer object to render into.
+static bool createHeadlessContext(int width, int height)
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != NULL)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) return false;
+    if (!eglBindAPI(EGL_OPENGL_API)) return false;
+
+    // No surface is ever created, so any surface type will do
+    EGLint configAttribs[] = { EGL_SURFACE_TYPE, 0, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint numConfigs;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1)
+        return false;
+
+    EGLint contextAttribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 2,
+                                EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                EGL_NONE };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT) return false;
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) return false;
+
+    glewExperimental = GL_TRUE; // Needed for core profiles without a window system
+    glewInit();
+    glGetError(); // glewInit can leave a harmless GL_INVALID_ENUM behind
+
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    CheckError();
+
+    printf("Headless %s context: %s\n", glGetString(GL_VERSION), glGetString(GL_RENDERER));
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+// Saves the framebuffer as a binary PPM, flipping it so the top row is first.
+static void dumpFrame(int frame)
+{
+    char fileName[512];
+    sprintf(fileName, "%s/frame%05d.ppm", dumpDir, frame);
+
+    static vector<unsigned char> pixels;
+    pixels.resize(windowWidth * windowHeight * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, windowWidth, windowHeight, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    CheckError();
+
+    FILE* f = fopen(fileName, "wb");
+    if (f == NULL) fileErr(fileName);
+    fprintf(f, "P6\n%d %d\n255\n", windowWidth, windowHeight);
+    for (int y = windowHeight-1; y >= 0; y--)
+        fwrite(&pixels[y * windowWidth * 3], 1, windowWidth * 3, f);
+    fclose(f);
+}
+
+// Renders headlessFrames frames, numbered from firstFrame, and reports the
+// time taken by each.
+static void timeHeadlessFrames(FILE* csv, int firstFrame)
+{
+    vector<double> frameTimes;
+    double totalLit = 0;
+    resetProfile();
+    for (int frame=firstFrame; frame < firstFrame + headlessFrames; frame++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        display();
+        chrono::steady_clock::time_point submitted = chrono::steady_clock::now();
+        glFinish(); // Include the GPU's work in the frame time
+        chrono::steady_clock::time_point finished = chrono::steady_clock::now();
+
+        GLuint litSamples = 0;
+        glGetQueryObjectuiv(litSamplesQuery, GL_QUERY_RESULT, &litSamples);
+        double litPerPixel = (double)litSamples / (windowWidth * windowHeight);
+        totalLit += litPerPixel;
+
+        chrono::duration<double, milli> displayTime = submitted - start, frameTime = finished - start;
+        frameTimes.push_back(frameTime.count());
+        if (csv != NULL)
+            fprintf(csv, "%d,%.3f,%.3f,%.3f,%s\n", frame, displayTime.count(), frameTime.count(),
+                    litPerPixel, drawStrategyName());
+
+        if (dumpDir != NULL) dumpFrame(frame);
+    }
+
+    if (frameTimes.empty()) return;
+    double total = 0;
+    for (size_t i=0; i < frameTimes.size(); i++) total += frameTimes[i];
+    sort(frameTimes.begin(), frameTimes.end());
+    printf("%d frames @ %d x %d, %d objects (%d drawn, %d culled, LOD %d/%d/%d/%d, %ld triangles),"
+           " %d lights (%s, mean %d and most %d per occupied cluster),"
+           " %s, %.2f lit fragments per pixel:"
+           " mean %.3f ms, min %.3f ms, median %.3f ms, max %.3f ms\n",
+           headlessFrames, windowWidth, windowHeight, nObjects, lastDrawn, lastCulled,
+           lastLodCounts[0], lastLodCounts[1], lastLodCounts[2], lastLodCounts[3], lastTriangles,
+           (int)lightData.size(), clusteredLighting ? "clustered" : "unclustered",
+           lastClusterLights, lastMaxClusterLights, drawStrategyName(),
+           totalLit / frameTimes.size(), total / frameTimes.size(),
+           frameTimes.front(), frameTimes[frameTimes.size()/2], frameTimes.back());
+    printProfile();
+}
+
+static void runHeadless()
+{
+    if (!createHeadlessContext(windowWidth, windowHeight)) {
+        printf("Error - could not create a headless EGL context\n");
+        exit(1);
+    }
+
+    init();
+    reshape(windowWidth, windowHeight);
+    waitForLoads(); // Time the rendering, not the loading
+
+    FILE* csv = NULL;
+    if (csvFileName != NULL) {
+        csv = fopen(csvFileName, "w");
+        if (csv == NULL) fileErr((char*)csvFileName);
+        fprintf(csv, "frame,display_ms,frame_ms,lit_per_pixel,strategy\n");
+    }
+
+    if (benchDepth) {
+        for (int i=0; i < 4; i++) {
+            frontToBack = i & 1;
+            depthPrepass = i & 2;
+            timeHeadlessFrames(csv, i * headlessFrames);
+        }
+    }
+    else timeHeadlessFrames(csv, 0);
+
+    if (csv != NULL) fclose(csv);
+}
+
+//----------------------------------------------------------------------------
+
 // Modified for Part[j]
 int main( int argc, char* argv[] )
 {
@@ -963,15 +6305,114 @@ int main( int argc, char* argv[] )
     for (char *cpointer = argv[0]; *cpointer != 0; cpointer++)
         if (*cpointer == '/' || *cpointer == '\\') programName = cpointer+1;
 
+    // Options start with '-'; the first other argument is the models-textures directory.
+    //   -compact   Use the compact interleaved vertex layout (see loadMeshIfNotAlreadyLoaded)
+    //   -syncload  Load meshes and textures on first use instead of in the background
+    //   -nomeshcache  Always load meshes with Assimp, ignoring the mesh cache
+    //   -bakemeshes   Build the mesh cache for every model, then exit
+    //   -compresstextures  Store textures as BC1 (see Texture loading)
+    //   -notexcache   Always decode the texture bitmaps, ignoring the texture cache
+    //   -baketextures Build the texture cache for every texture, then exit
+    //   -noprogramcache  Always compile the shader variants (see Shader program)
+    //   -nowatch      Don't reload the shaders when they change (see Shader reloading)
+    //   -nopersistent Orphan the per-object buffer each frame rather than mapping it
+    //                 persistently (see Per-object data)
+    //   -profile      Start with profiling and its overlay on (see Profiling)
+    //   -trace file   Profile, and write a Chrome trace to file at exit
+    //   -size WxH     Window (or headless framebuffer) size
+    //   -seed N       Random seed for the starting scene
+    //   -headless N   Render N frames offscreen and exit (see Headless rendering)
+    //   -csv file     Per-frame timings for -headless
+    //   -dump dir     Save each -headless frame as a PPM image in dir
+    //   -scene file   Start with the scene saved in file (see Scene files)
+    //   -savescene file  Where 's' and "Save Scene" save to, default scene.scn
+    //   -continuous   Redraw continuously rather than only when something changes
+    //   -fpscap N     Draw at most N frames per second
+    //   -noculling    Start with frustum culling off
+    //   -nolod        Always draw meshes at full detail (see Level of detail selection)
+    //   -fronttoback  Start drawing nearest objects first (see Draw order and depth pre-pass)
+    //   -depthprepass Start with the depth pre-pass on
+    //   -benchdepth   With -headless, time each draw order with and without the pre-pass
+    //   -noclusters   Start with every light in one cluster (see Clustered lighting)
+    //   -stresslights N  Start with a scene lit by N point lights
+    //   -benchtransforms N  Time the batched model-view matrices for N objects, then exit
+    //   -benchbvh N   Time culling and picking with the BVH for N objects, then exit
+    char *dirArg = NULL;
+    bool bakeMeshes = false, bakeTextures = false;
+    int benchObjects = 0, benchBVHObjects = 0;
+    for (int i=1; i < argc; i++) {
+        if (strcmp(argv[i], "-compact") == 0) compactVertices = true;
+        else if (strcmp(argv[i], "-syncload") == 0) syncLoading = true;
+        else if (strcmp(argv[i], "-nomeshcache") == 0) useMeshCache = false;
+        else if (strcmp(argv[i], "-bakemeshes") == 0) bakeMeshes = true;
+        else if (strcmp(argv[i], "-compresstextures") == 0) compressTextures = true;
+        else if (strcmp(argv[i], "-notexcache") == 0) useTextureCache = false;
+        else if (strcmp(argv[i], "-baketextures") == 0) bakeTextures = true;
+        else if (strcmp(argv[i], "-noprogramcache") == 0) useProgramCache = false;
+        else if (strcmp(argv[i], "-nowatch") == 0) watchShaders = false;
+        else if (strcmp(argv[i], "-nopersistent") == 0) persistentStreaming = false;
+        else if (strcmp(argv[i], "-profile") == 0) profiling = profileOverlay = true;
+        else if (strcmp(argv[i], "-trace") == 0 && i+1 < argc) {
+            traceFileName = argv[++i];
+            profiling = true;
+        }
+        else if (strcmp(argv[i], "-size") == 0 && i+1 < argc)
+            sscanf(argv[++i], "%dx%d", &windowWidth, &windowHeight);
+        else if (strcmp(argv[i], "-seed") == 0 && i+1 < argc) {
+            randomSeed = atoi(argv[++i]);
+            fixedSeed = true;
+        }
+        else if (strcmp(argv[i], "-headless") == 0 && i+1 < argc) {
+            headless = true;
+            headlessFrames = atoi(argv[++i]);
+            fixedSeed = true;
+        }
+        else if (strcmp(argv[i], "-csv") == 0 && i+1 < argc) csvFileName = argv[++i];
+        else if (strcmp(argv[i], "-dump") == 0 && i+1 < argc) dumpDir = argv[++i];
+        else if (strcmp(argv[i], "-scene") == 0 && i+1 < argc) sceneFileName = argv[++i];
+        else if (strcmp(argv[i], "-savescene") == 0 && i+1 < argc) saveSceneFileName = argv[++i];
+        else if (strcmp(argv[i], "-continuous") == 0) continuousRedraw = true;
+        else if (strcmp(argv[i], "-fpscap") == 0 && i+1 < argc) fpsCap = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-noculling") == 0) frustumCulling = false;
+        else if (strcmp(argv[i], "-nolod") == 0) lodSelection = false;
+        else if (strcmp(argv[i], "-fronttoback") == 0) frontToBack = true;
+        else if (strcmp(argv[i], "-depthprepass") == 0) depthPrepass = true;
+        else if (strcmp(argv[i], "-benchdepth") == 0) benchDepth = true;
+        else if (strcmp(argv[i], "-noclusters") == 0) clusteredLighting = false;
+        else if (strcmp(argv[i], "-stresslights") == 0 && i+1 < argc) stressLights = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-benchtransforms") == 0 && i+1 < argc) benchObjects = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-benchbvh") == 0 && i+1 < argc) benchBVHObjects = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && dirArg == NULL) dirArg = argv[i];
+    }
+
+    if (benchObjects > 0 || benchBVHObjects > 0) {
+        if (benchObjects > 0) benchTransforms(benchObjects);
+        if (benchBVHObjects > 0) benchBVH(benchBVHObjects);
+        return 0;
+    }
+
     // Set the models-textures directory, via the first argument or some handy defaults.
-    if (argc > 1)
-        strcpy(dataDir, argv[1]);
+    if (dirArg != NULL)
+        strcpy(dataDir, dirArg);
     else if (opendir(dirDefault1)) strcpy(dataDir, dirDefault1);
     else if (opendir(dirDefault2)) strcpy(dataDir, dirDefault2);
     else if (opendir(dirDefault3)) strcpy(dataDir, dirDefault3);
     else if (opendir(dirDefault4)) strcpy(dataDir, dirDefault4);
     else fileErr(dirDefault1);
 
+    if (bakeMeshes || bakeTextures) {
+        if (bakeMeshes) bakeMeshCaches();
+        if (bakeTextures) bakeTextureCaches();
+        return 0;
+    }
+
+    if (traceFileName != NULL) atexit(writeTrace);
+
+    if (headless) {
+        runHeadless();
+        return 0;
+    }
+
     glutInit( &argc, argv );
     glutInitDisplayMode( GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH );
     glutInitWindowSize( windowWidth, windowHeight );
@@ -990,14 +6431,15 @@ int main( int argc, char* argv[] )
 
     glutDisplayFunc( display );
     glutKeyboardFunc( keyboard );
-    glutIdleFunc( idle );
+    setRedrawMode(continuousRedraw);
+    glutTimerFunc( 0, redrawTick, 0 );
 
     // Added for Part[j]
     glutSpecialFunc(up_func);
 
     glutMouseFunc( mouseClickOrScroll );
     glutPassiveMotionFunc(mousePassiveMotion);
-    glutMotionFunc( doToolUpdateXY );
+    glutMotionFunc( mouseDrag );
  
     glutReshapeFunc( reshape );
     glutTimerFunc( 1000, timer, 1 );
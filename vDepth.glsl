@@ -0,0 +1,23 @@
+// Vertex shader for the depth pre-pass (see Depth pre-pass in scene-start.cpp).
+// Only the position is needed, worked out exactly as in vStart.glsl.
+#version 150
+
+in vec3 vPosition;
+in mat4 iModel;
+
+invariant gl_Position;
+
+uniform mat4 ModelView;
+uniform mat4 Projection;
+uniform bool Instanced;
+
+void main()
+{
+    vec4 vpos = vec4(vPosition, 1.0);
+
+    mat4 modelView = ModelView;
+    if (Instanced)
+        modelView = ModelView * iModel;
+
+    gl_Position = Projection * modelView * vpos;
+}
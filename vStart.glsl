@@ -1,30 +1,82 @@
 //Modified for Part[g] - Light calculations removed
-attribute vec3 vPosition;
-attribute vec3 vNormal;
-attribute vec2 vTexCoord;
+#version 150
 
-varying vec2 texCoord;
-varying vec3 pos;
-varying vec3 fN;
+in vec3 vPosition;
+in vec3 vNormal;
+in vec2 vTexCoord;
+
+// Per-instance attributes, only used when Instanced is set (see drawInstanced
+// in scene-start.cpp).  iModel then holds the whole model-view matrix and
+// ModelView the identity.
+in mat4 iModel;
+in vec3 iAmbient, iDiffuse, iSpecular;
+in vec2 iShineTexScale;
+
+out vec2 texCoord;
+out vec3 pos;
+out vec3 fN;
+
+// Material terms for the fragment shader, either from ObjectBlock or the
+// instance attributes
+flat out vec3 fAmbient, fDiffuse, fSpecular;
+flat out float fShininess, fTexScale;
+
+// gl_Position is computed exactly as in vDepth.glsl, so the depths from the
+// depth pre-pass match these (see Depth pre-pass in scene-start.cpp)
+invariant gl_Position;
 
 uniform mat4 ModelView;
 uniform mat4 Projection;
+uniform bool Instanced;
 
-//uniform vec3 AmbientProduct, DiffuseProduct, SpecularProduct;
-//uniform float Shininess;
-//varying vec4 color;
+// The object's own terms when Instanced isn't set: record ObjectIndex of the
+// block bound to ObjectBlock, from the buffer written each frame by
+// uploadObjects.  std140 layout - must match ObjectData in scene-start.cpp.
+#define OBJECTS_PER_BLOCK 128 // Must match objectsPerBlock
+
+struct ObjectData {
+    mat4 modelView;
+    vec3 ambientProduct;  float shininess;
+    vec3 diffuseProduct;  float texScale;
+    vec3 specularProduct;
+};
+
+layout(std140) uniform ObjectBlock {
+    ObjectData objects[OBJECTS_PER_BLOCK];
+};
+uniform int ObjectIndex;
+//out vec4 color;
 
 void main()
 {
     //Items commented out for putting in fshader (Part G)
     vec4 vpos = vec4(vPosition, 1.0);
 
+    // Instanced draws never read ObjectBlock, which may then be a dummy buffer
+    mat4 modelView;
+    if (Instanced) {
+        modelView = ModelView * iModel;
+        fAmbient = iAmbient;
+        fDiffuse = iDiffuse;
+        fSpecular = iSpecular;
+        fShininess = iShineTexScale.x;
+        fTexScale = iShineTexScale.y;
+    }
+    else {
+        modelView = objects[ObjectIndex].modelView;
+        fAmbient = objects[ObjectIndex].ambientProduct;
+        fDiffuse = objects[ObjectIndex].diffuseProduct;
+        fSpecular = objects[ObjectIndex].specularProduct;
+        fShininess = objects[ObjectIndex].shininess;
+        fTexScale = objects[ObjectIndex].texScale;
+    }
+
     // Transform vertex position into eye coordinates
-    pos = (ModelView * vpos).xyz;
+    pos = (modelView * vpos).xyz;
 
     // Transform vertex normal into eye coordinates (assumes scaling
     // is uniform across dimensions)
-    fN = normalize( (ModelView*vec4(vNormal, 0.0)).xyz );
+    fN = normalize( (modelView*vec4(vNormal, 0.0)).xyz );
 
     // The vector to the light from the vertex    
     //Lvec = LightPosition.xyz - pos;
@@ -58,6 +110,6 @@ void main()
     //color.rgb = globalAmbient + distscale*(ambient + diffuse + specular);
     //color.a = 1.0;
 
-    gl_Position = Projection * ModelView * vpos;
+    gl_Position = Projection * modelView * vpos;
     texCoord = vTexCoord;
 }